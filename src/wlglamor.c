@@ -52,6 +52,7 @@
 /* All drivers using framebuffer need this */
 #include "fb.h"
 #include "picturestr.h"
+#include "damagestr.h"
 
 /* All drivers using xwayland module need this */
 #include "xwayland.h"
@@ -66,12 +67,17 @@
 #include <sys/mman.h>
 #include <unistd.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
 
 /* These need to be checked */
 #include <X11/X.h>
 #include <X11/Xproto.h>
 #include "scrnintstr.h"
 #include "servermd.h"
+#include "xace.h"
+#include "property.h"
+#include <X11/Xatom.h>
 
 
 #include <dri2.h>
@@ -84,12 +90,17 @@
 
 #include "driver_name.h"
 
-static DevPrivateKeyRec wlglamor_pixmap_private_key_rec;
-#define wlglamor_pixmap_private_key  (&wlglamor_pixmap_private_key_rec)
+DevPrivateKeyRec wlglamor_pixmap_private_key_rec;
+
+static DevPrivateKeyRec wlglamor_window_private_key_rec;
+#define wlglamor_window_private_key  (&wlglamor_window_private_key_rec)
+
+static DevPrivateKeyRec wlglamor_gc_private_key_rec;
+#define wlglamor_gc_private_key  (&wlglamor_gc_private_key_rec)
 
 
 static int
-wlglamor_get_name_from_bo (int fd, struct gbm_bo *bo, int *name)
+wlglamor_get_name_from_bo (int fd, struct gbm_bo *bo, uint32_t *name)
 {
   struct drm_gem_flink flink;
   union gbm_bo_handle handle;
@@ -102,6 +113,38 @@ wlglamor_get_name_from_bo (int fd, struct gbm_bo *bo, int *name)
   return TRUE;
 }
 
+void
+wlglamor_gem_close (int fd, uint32_t handle)
+{
+  struct drm_gem_close close_bo;
+
+  memset (&close_bo, 0, sizeof (close_bo));
+  close_bo.handle = handle;
+  ioctl (fd, DRM_IOCTL_GEM_CLOSE, &close_bo);
+}
+
+/* Depth 24 buffers carry no meaningful alpha, so export them as XRGB and
+ * let the compositor treat the window as opaque instead of blending it. */
+static uint32_t
+wlglamor_gbm_format_for_depth (int depth)
+{
+  switch (depth)
+    {
+    case 32:
+      return GBM_FORMAT_ARGB8888;
+    case 24:
+    default:
+      return GBM_FORMAT_XRGB8888;
+    }
+}
+
+/* glamor_egl can only make a texture of 24 and 32 bit deep BOs */
+Bool
+wlglamor_depth_is_textured (int depth)
+{
+  return depth == 24 || depth == 32;
+}
+
 static Bool
 wlglamor_get_device (ScrnInfoPtr pScrn)
 {
@@ -149,6 +192,353 @@ wlglamor_adjust_frame (ADJUST_FRAME_ARGS_DECL)
 {
 }
 
+static void wlglamor_resize_pool_expire (struct wlglamor_device *wlglamor,
+					 Bool all);
+static void wlglamor_front_expose (struct wlglamor_device *wlglamor);
+static void wlglamor_front_release (struct wlglamor_device *wlglamor);
+static struct wlglamor_window *wlglamor_window_priv (WindowPtr window);
+static void wlglamor_capture_fini (struct wlglamor_device *wlglamor);
+
+static void
+wlglamor_dirty_report (DamagePtr damage, RegionPtr region, void *closure)
+{
+  struct wlglamor_dirty *dirty = closure;
+
+  if (xorg_list_is_empty (&dirty->link))
+    xorg_list_add (&dirty->link, &dirty->wlglamor->dirty_pixmaps);
+}
+
+static void
+wlglamor_dirty_destroy (DamagePtr damage, void *closure)
+{
+  struct wlglamor_dirty *dirty = closure;
+
+  xorg_list_del (&dirty->link);
+  free (dirty);
+}
+
+/* Watch a pixmap xwayland may hand to the compositor, a window backing
+ * pixmap or the rooted front. It starts out dirty: a new one is only
+ * created when a window is mapped or resized, which needs a post too. */
+static void
+wlglamor_dirty_track (struct wlglamor_device *wlglamor, PixmapPtr pixmap)
+{
+  ScreenPtr screen = pixmap->drawable.pScreen;
+  struct wlglamor_dirty *dirty;
+
+  dirty = calloc (1, sizeof (struct wlglamor_dirty));
+  if (dirty)
+    {
+      dirty->wlglamor = wlglamor;
+      xorg_list_init (&dirty->link);
+      dirty->damage = DamageCreate (wlglamor_dirty_report,
+				    wlglamor_dirty_destroy,
+				    DamageReportRawRegion, TRUE, screen,
+				    dirty);
+    }
+  if (!dirty || !dirty->damage)
+    {
+      /* Can't tell when it changes any more, post every time */
+      free (dirty);
+      wlglamor->dirty_untracked = TRUE;
+      return;
+    }
+
+  DamageRegister (&pixmap->drawable, dirty->damage);
+  xorg_list_add (&dirty->link, &wlglamor->dirty_pixmaps);
+}
+
+/*
+ * The window damage xwayland turns into wl_surface.damage requests, one
+ * per box. It is created with DamageReportNonEmpty and read back as a
+ * whole, so it can be replaced by a larger region without losing
+ * anything. xwayland registers it from RealizeWindow, which is how it is
+ * told from the damage of DAMAGE extension clients; its report callback
+ * is hooked to learn which windows have some since the last post.
+ */
+static Bool
+wlglamor_realize_window (WindowPtr window)
+{
+  ScreenPtr screen = window->drawable.pScreen;
+  struct wlglamor_device *wlglamor = wlglamor_screen_priv (screen);
+  Bool ret;
+
+  wlglamor->realizing_window = window;
+  screen->RealizeWindow = wlglamor->RealizeWindow;
+  ret = (*screen->RealizeWindow) (window);
+  wlglamor->RealizeWindow = screen->RealizeWindow;
+  screen->RealizeWindow = wlglamor_realize_window;
+  wlglamor->realizing_window = NULL;
+
+  return ret;
+}
+
+static void
+wlglamor_window_damage_report (DamagePtr damage, RegionPtr region,
+			       void *closure)
+{
+  struct wlglamor_device *wlglamor = wlglamor_screen_priv (damage->pScreen);
+  struct wlglamor_window *priv =
+    wlglamor_window_priv ((WindowPtr) damage->pDrawable);
+
+  if (xorg_list_is_empty (&priv->damage_link))
+    xorg_list_add (&priv->damage_link, &wlglamor->damaged_windows);
+  (*priv->damage_report) (damage, region, closure);
+}
+
+static void
+wlglamor_damage_register (DrawablePtr drawable, DamagePtr damage)
+{
+  struct wlglamor_device *wlglamor = wlglamor_screen_priv (drawable->pScreen);
+  struct wlglamor_window *priv;
+
+  (*wlglamor->DamageRegister) (drawable, damage);
+
+  if ((WindowPtr) drawable != wlglamor->realizing_window ||
+      damage->damageLevel != DamageReportNonEmpty || !damage->damageReport)
+    return;
+
+  priv = wlglamor_window_priv ((WindowPtr) drawable);
+  if (priv->damage)
+    return;
+  priv->damage = damage;
+  priv->damage_report = damage->damageReport;
+  damage->damageReport = wlglamor_window_damage_report;
+  xorg_list_init (&priv->damage_link);
+}
+
+static void
+wlglamor_damage_forget (DrawablePtr drawable, DamagePtr damage)
+{
+  struct wlglamor_window *priv;
+
+  if (drawable->type != DRAWABLE_WINDOW)
+    return;
+  priv = wlglamor_window_priv ((WindowPtr) drawable);
+  if (priv->damage != damage)
+    return;
+
+  damage->damageReport = priv->damage_report;
+  xorg_list_del (&priv->damage_link);
+  priv->damage = NULL;
+}
+
+static void
+wlglamor_damage_unregister (DrawablePtr drawable, DamagePtr damage)
+{
+  struct wlglamor_device *wlglamor = wlglamor_screen_priv (drawable->pScreen);
+
+  wlglamor_damage_forget (drawable, damage);
+  (*wlglamor->DamageUnregister) (drawable, damage);
+}
+
+static void
+wlglamor_damage_destroy (DamagePtr damage)
+{
+  struct wlglamor_device *wlglamor = wlglamor_screen_priv (damage->pScreen);
+
+  if (damage->pDrawable)
+    wlglamor_damage_forget (damage->pDrawable, damage);
+  (*wlglamor->DamageDestroy) (damage);
+}
+
+/* Wrapped last, so it runs first: windows are gone, the damage screen
+ * private still here */
+static Bool
+wlglamor_damage_close_screen (CLOSE_SCREEN_ARGS_DECL)
+{
+  struct wlglamor_device *wlglamor = wlglamor_screen_priv (pScreen);
+  DamageScreenFuncsPtr funcs = DamageGetScreenFuncs (pScreen);
+
+  funcs->Register = wlglamor->DamageRegister;
+  funcs->Unregister = wlglamor->DamageUnregister;
+  funcs->Destroy = wlglamor->DamageDestroy;
+  pScreen->RealizeWindow = wlglamor->RealizeWindow;
+  pScreen->CloseScreen = wlglamor->DamageCloseScreen;
+  return (*pScreen->CloseScreen) (CLOSE_SCREEN_ARGS);
+}
+
+static int64_t
+wlglamor_box_area (BoxPtr box)
+{
+  return (int64_t) (box->x2 - box->x1) * (box->y2 - box->y1);
+}
+
+/* Merge each box into the previous one when the pixels this adds are
+ * worth less than a request of its own. Returns the boxes left. */
+static int
+wlglamor_merge_boxes (BoxPtr boxes, int n, int64_t cost)
+{
+  int i, m = 1;
+
+  for (i = 1; i < n; i++)
+    {
+      BoxPtr last = &boxes[m - 1], box = &boxes[i];
+      BoxRec merged;
+
+      merged.x1 = min (last->x1, box->x1);
+      merged.y1 = min (last->y1, box->y1);
+      merged.x2 = max (last->x2, box->x2);
+      merged.y2 = max (last->y2, box->y2);
+      if (wlglamor_box_area (&merged) - wlglamor_box_area (last) -
+	  wlglamor_box_area (box) <= cost)
+	*last = merged;
+      else
+	boxes[m++] = *box;
+    }
+
+  return m;
+}
+
+/* Bring a region of many small boxes down to damage_compact_rects boxes
+ * at most, growing it as little as the cost model allows. */
+static void
+wlglamor_damage_compact (struct wlglamor_device *wlglamor, RegionPtr region)
+{
+  int64_t cost = wlglamor->damage_request_cost;
+  int i, n = RegionNumRects (region);
+  RegionRec compact;
+  BoxPtr boxes;
+
+  if (n <= wlglamor->damage_compact_threshold)
+    return;
+
+  boxes = malloc (n * sizeof (BoxRec));
+  if (!boxes)
+    return;
+  memcpy (boxes, RegionRects (region), n * sizeof (BoxRec));
+
+  n = wlglamor_merge_boxes (boxes, n, cost);
+  while (n > wlglamor->damage_compact_rects)
+    {
+      cost = cost * 4 + 1;
+      n = wlglamor_merge_boxes (boxes, n, cost);
+    }
+
+  RegionInit (&compact, &boxes[0], 1);
+  for (i = 1; i < n; i++)
+    {
+      RegionRec box;
+
+      RegionInit (&box, &boxes[i], 1);
+      RegionUnion (&compact, &compact, &box);
+      RegionUninit (&box);
+    }
+
+  /* Overlapping merged boxes can be split again when banded */
+  if (RegionNumRects (&compact) > wlglamor->damage_compact_rects)
+    {
+      BoxRec extents = *RegionExtents (region);
+
+      RegionReset (region, &extents);
+    }
+  else
+    RegionCopy (region, &compact);
+
+  RegionUninit (&compact);
+  free (boxes);
+}
+
+/* xwl_screen_post_damage walks every window: skip it when nothing that
+ * reaches the compositor was drawn to since the last post. */
+static void
+wlglamor_post_damage (struct wlglamor_device *wlglamor)
+{
+  struct wlglamor_window *priv, *tmp;
+
+  if (!wlglamor->xwl_screen)
+    return;
+  if (xorg_list_is_empty (&wlglamor->dirty_pixmaps) &&
+      !wlglamor->dirty_untracked)
+    return;
+
+  xorg_list_for_each_entry (priv, &wlglamor->damaged_windows, damage_link)
+    wlglamor_damage_compact (wlglamor, DamageRegion (priv->damage));
+
+  xwl_screen_post_damage (wlglamor->xwl_screen);
+
+  /* What xwayland could not post yet is not reported again */
+  xorg_list_for_each_entry_safe (priv, tmp, &wlglamor->damaged_windows,
+				 damage_link)
+    if (!RegionNotEmpty (DamageRegion (priv->damage)))
+      xorg_list_del (&priv->damage_link);
+
+  while (!xorg_list_is_empty (&wlglamor->dirty_pixmaps))
+    xorg_list_del (wlglamor->dirty_pixmaps.next);
+}
+
+/*
+ * Counters of the memory saving paths, published as the STRING property
+ * WLGLAMOR_STATISTICS on the root window, one "name value" per line,
+ * followed by a "client <resource base> <bytes> <peak>" line for each
+ * client that has BOs charged to it. Refreshed from the block handler
+ * at most every WLGLAMOR_STATISTICS_INTERVAL ms, and only rewritten when
+ * a value changed so that clients watching the root window are not woken
+ * up.
+ */
+static void
+wlglamor_statistics_update (ScreenPtr screen)
+{
+  struct wlglamor_device *wlglamor = wlglamor_screen_priv (screen);
+  CARD32 now = GetTimeInMillis ();
+  size_t size = 512 + currentMaxClients * 64;
+  char *buf;
+  int i, len;
+
+  if (!screen->root ||
+      (CARD32) (now - wlglamor->statistics_time) <
+      WLGLAMOR_STATISTICS_INTERVAL)
+    return;
+  wlglamor->statistics_time = now;
+
+  buf = malloc (size);
+  if (!buf)
+    return;
+  len = snprintf (buf, size,
+		  "bo_bytes %llu\n"
+		  "cold_pixmap_bytes %llu\n"
+		  "cold_stored_bytes %llu\n"
+		  "dedup_saved_bytes %llu\n"
+		  "dedup_saved_peak_bytes %llu\n"
+		  "alloc_failures %lu\n"
+		  "alloc_failures_skipped %lu\n",
+		  (unsigned long long) wlglamor->bo_bytes,
+		  (unsigned long long) wlglamor->cold_raw_bytes,
+		  (unsigned long long) wlglamor->cold_bytes,
+		  (unsigned long long) wlglamor->dedup_saved,
+		  (unsigned long long) wlglamor->dedup_saved_peak,
+		  wlglamor->num_alloc_failures, wlglamor->num_alloc_failure_hits);
+  for (i = 1; i < currentMaxClients; i++)
+    {
+      struct wlglamor_client_usage *usage = &wlglamor->client_usage[i];
+
+      if (!clients[i] || !usage->peak)
+	continue;
+      len += snprintf (buf + len, size - len, "client 0x%lx %llu %llu\n",
+		       (unsigned long) clients[i]->clientAsMask,
+		       (unsigned long long) usage->bytes,
+		       (unsigned long long) usage->peak);
+    }
+  if (wlglamor->statistics && !strcmp (buf, wlglamor->statistics))
+    {
+      free (buf);
+      return;
+    }
+
+  if (!wlglamor->statistics_atom)
+    wlglamor->statistics_atom = MakeAtom ("WLGLAMOR_STATISTICS",
+					  strlen ("WLGLAMOR_STATISTICS"), TRUE);
+  if (dixChangeWindowProperty (serverClient, screen->root,
+			       wlglamor->statistics_atom, XA_STRING, 8,
+			       PropModeReplace, len, buf, TRUE) != Success)
+    {
+      free (buf);
+      return;
+    }
+  free (wlglamor->statistics);
+  wlglamor->statistics = buf;
+}
+
 void
 wlglamor_block_handler (BLOCKHANDLER_ARGS_DECL)
 {
@@ -160,9 +550,51 @@ wlglamor_block_handler (BLOCKHANDLER_ARGS_DECL)
   (*pScreen->BlockHandler) (BLOCKHANDLER_ARGS);
   pScreen->BlockHandler = wlglamor_block_handler;
 
-  glamor_block_handler (pScreen);	/* flushes */
-  if (wlglamor->xwl_screen)
-    xwl_screen_post_damage (wlglamor->xwl_screen);
+  /* The flush must reach the kernel before the compositor sees the
+   * damage: synchronization with it is implicit, through the reservation
+   * on the shared BOs, as neither wl_drm nor the wl_surface commits done
+   * by xwayland can carry a fence. */
+  glamor_block_handler (pScreen);
+  wlglamor->unflushed = FALSE;
+  if (!xorg_list_is_empty (&wlglamor->shm_pixmaps))
+    wlglamor_shm_sync (wlglamor);
+  wlglamor_post_damage (wlglamor);
+  wlglamor->resizing_window = 0;
+
+  /* We are about to sleep, a good time for the GEM closes and EGLImage
+   * teardowns that were deferred from the request handlers. */
+  if (wlglamor->trim_pending)
+    wlglamor_trim (wlglamor);
+  else
+    wlglamor_drain_deferred_destroy (wlglamor);
+  if (!xorg_list_is_empty (&wlglamor->fallback_pixmaps))
+    wlglamor_promote_fallbacks (wlglamor);
+
+  if (wlglamor->lazy_front)
+    {
+      if (wlglamor->front_exposed)
+	wlglamor_front_expose (wlglamor);
+      wlglamor_front_release (wlglamor);
+    }
+
+  if (wlglamor->capture_pixmap)
+    {
+      CARD32 idle = GetTimeInMillis () - wlglamor->capture_last_use;
+
+      if (idle >= WLGLAMOR_CAPTURE_TIMEOUT)
+	wlglamor_capture_fini (wlglamor);
+      else
+	AdjustWaitForDelay (pTimeout, WLGLAMOR_CAPTURE_TIMEOUT - idle);
+    }
+
+  if (wlglamor->num_resize_pool)
+    {
+      wlglamor_resize_pool_expire (wlglamor, FALSE);
+      if (wlglamor->num_resize_pool)
+	AdjustWaitForDelay (pTimeout, WLGLAMOR_RESIZE_SETTLE);
+    }
+
+  wlglamor_statistics_update (pScreen);
 }
 
 static void
@@ -177,8 +609,8 @@ wlglamor_flush_callback (CallbackListPtr * list,
   if (pScrn->vtSema)
     {
       glamor_block_handler (screen);
-      if (wlglamor->xwl_screen)
-	xwl_screen_post_damage (wlglamor->xwl_screen);
+      wlglamor->unflushed = FALSE;
+      wlglamor_post_damage (wlglamor);
     }
 }
 
@@ -192,16 +624,49 @@ wlglamor_auth_magic (ClientPtr client, ScreenPtr pScreen, uint32_t magic)
 
 typedef DRI2BufferPtr BufferPtr;
 
+static void wlglamor_client_accounting_fini (struct wlglamor_device
+					     *wlglamor);
+static void wlglamor_picture_fini (ScreenPtr screen);
+
 static Bool
 wlglamor_close_screen (CLOSE_SCREEN_ARGS_DECL)
 {
   ScrnInfoPtr pScrn = xf86ScreenToScrn (pScreen);
   struct wlglamor_device *wlglamor = wlglamor_scrninfo_priv (pScrn);
 
+  /* From here on pixmaps are freed right away, xwl_screen_close and the
+   * wrapped CloseScreen still free some */
+  wlglamor->closing = TRUE;
+  wlglamor_drain_deferred_destroy (wlglamor);
+  wlglamor_capture_fini (wlglamor);
+  wlglamor_pressure_fini (wlglamor);
+  if (wlglamor->cold_raw_bytes)
+    xf86DrvMsg (pScrn->scrnIndex, X_INFO,
+		"Cold pixmap store: %llu KiB held in %llu KiB\n",
+		(unsigned long long) (wlglamor->cold_raw_bytes >> 10),
+		(unsigned long long) (wlglamor->cold_bytes >> 10));
+  if (wlglamor->num_alloc_failures)
+    xf86DrvMsg (pScrn->scrnIndex, X_INFO,
+		"%lu BO allocations failed, %lu more skipped as known bad\n",
+		wlglamor->num_alloc_failures,
+		wlglamor->num_alloc_failure_hits);
+  if (wlglamor->dedup)
+    xf86DrvMsg (pScrn->scrnIndex, X_INFO,
+		"Pixmap dedup: %llu KiB saved, %llu KiB at peak\n",
+		(unsigned long long) (wlglamor->dedup_saved >> 10),
+		(unsigned long long) (wlglamor->dedup_saved_peak >> 10));
+  pScreen->CreateGC = wlglamor->CreateGC;
+  pScreen->SourceValidate = wlglamor->SourceValidate;
+  pScreen->GetImage = wlglamor->GetImage;
+  pScreen->CopyWindow = wlglamor->CopyWindow;
+  pScreen->ConfigNotify = wlglamor->ConfigNotify;
+  wlglamor_picture_fini (pScreen);
   xwl_screen_close (wlglamor->xwl_screen);
   DeleteCallback (&FlushCallback, wlglamor_flush_callback, pScrn);
+  wlglamor_client_accounting_fini (wlglamor);
   /* TODO: Probably other things to clean up */
   pScrn->vtSema = FALSE;
+  wlglamor_resize_pool_expire (wlglamor, TRUE);
   pScreen->CloseScreen = wlglamor->CloseScreen;
   return (*pScreen->CloseScreen) (CLOSE_SCREEN_ARGS);
 }
@@ -217,6 +682,8 @@ wlglamor_free_screen (FREE_SCREEN_ARGS_DECL)
     {
       if (wlglamor->front_bo)
 	gbm_bo_destroy (wlglamor->front_bo);
+      if (wlglamor->front_placeholder)
+	gbm_bo_destroy (wlglamor->front_placeholder);
       /* Note: gbm_bo_destroy only dereference if the buffer is used outside.
        * If the compositor use it, it will only be deleted when the 
        * compositor delete it */
@@ -224,6 +691,7 @@ wlglamor_free_screen (FREE_SCREEN_ARGS_DECL)
       if (wlglamor->xwl_screen)
 	xwl_screen_destroy (wlglamor->xwl_screen);
       wlglamor->xwl_screen = NULL;
+      free (wlglamor->statistics);
     }
 
   free (pScrn->driverPrivate);
@@ -251,125 +719,1666 @@ wlglamor_create_screen_resources (ScreenPtr screen)
 
   if (!wlglamor->xwl_screen)
     return FALSE;
+  /* xwayland reads and dispatches the Wayland events, and flushes its
+   * requests, from block and wakeup handlers it registers here, on the
+   * server thread. The wl_display is xwayland's: the driver cannot move
+   * that I/O to a thread of its own without racing with it, it can only
+   * post less often and with fewer requests, see wlglamor_post_damage. */
   if (xwl_screen_init (wlglamor->xwl_screen, screen) != Success)
     return FALSE;
 
-  if (!glamor_glyphs_init (screen))
+  if (wlglamor->damage_compact_threshold)
+    {
+      DamageScreenFuncsPtr funcs = DamageGetScreenFuncs (screen);
+
+      wlglamor->DamageRegister = funcs->Register;
+      funcs->Register = wlglamor_damage_register;
+      wlglamor->DamageUnregister = funcs->Unregister;
+      funcs->Unregister = wlglamor_damage_unregister;
+      wlglamor->DamageDestroy = funcs->Destroy;
+      funcs->Destroy = wlglamor_damage_destroy;
+
+      /* Outside xwayland's, which registers its damage */
+      wlglamor->RealizeWindow = screen->RealizeWindow;
+      screen->RealizeWindow = wlglamor_realize_window;
+      wlglamor->DamageCloseScreen = screen->CloseScreen;
+      screen->CloseScreen = wlglamor_damage_close_screen;
+    }
+
+  if (!glamor_glyphs_init (screen))
+    return FALSE;
+
+  /* We have to put a valid buffer for the screen pixmap .
+   * For initialization, we have put a buffer outside graphic 
+   * memory. Now we can create pixmaps, we allocate a correct
+   * pixmap for the screen pixmap. */
+
+  wlglamor->front_pixmap = fbCreatePixmap (screen, 0, 0, pScrn->depth, 0);
+  if (wlglamor->front_pixmap == NullPixmap)
+    return FALSE;
+
+  priv = calloc (1, sizeof (struct wlglamor_pixmap));
+  if (priv == NULL)
+    return FALSE;
+
+  priv->bo = wlglamor->front_bo;
+  priv->refcount = 1;
+  priv->pixmap = wlglamor->front_pixmap;
+  priv->exported = !wlglamor->lazy_front;
+  xorg_list_init (&priv->link);
+  wlglamor->front_last_use = GetTimeInMillis ();
+
+  dixSetPrivate (&wlglamor->front_pixmap->devPrivates,
+		 wlglamor_pixmap_private_key, priv);
+  screen->ModifyPixmapHeader (wlglamor->front_pixmap,
+			      pScrn->virtualX, pScrn->virtualY, 0, 0,
+			      gbm_bo_get_stride (wlglamor->front_bo), NULL);
+
+  screen->SetScreenPixmap (wlglamor->front_pixmap);
+  if (!xorgRootless)
+    wlglamor_dirty_track (wlglamor, wlglamor->front_pixmap);
+
+  handle = gbm_bo_get_handle (wlglamor->front_bo);
+  if (!glamor_egl_create_textured_screen_ext (screen,
+					      handle.u32,
+					      gbm_bo_get_stride 
+						  (wlglamor->front_bo),
+					      NULL))
+    return FALSE;
+
+  return TRUE;
+}
+
+struct dri2_buffer_priv
+{
+  PixmapPtr pixmap;
+  unsigned int attachment;
+  unsigned int refcnt;
+  unsigned int frame;		/* frame held by the buffer, 0 if unknown */
+};
+
+static struct wlglamor_window *
+wlglamor_window_priv (WindowPtr window)
+{
+  return dixGetPrivateAddr (&window->devPrivates, wlglamor_window_private_key);
+}
+
+/* Number of full swaps done on a window, the per drawable frame counter
+ * against which the age of its DRI2 buffers is computed. */
+static unsigned int *
+wlglamor_window_frame (WindowPtr window)
+{
+  return &wlglamor_window_priv (window)->frame;
+}
+
+/* Was the window resized a moment ago? */
+static Bool
+wlglamor_window_resizing (WindowPtr window)
+{
+  struct wlglamor_window *priv = wlglamor_window_priv (window);
+
+  return priv->last_resize &&
+    (CARD32) (GetTimeInMillis () - priv->last_resize) <
+    WLGLAMOR_RESIZE_SETTLE;
+}
+
+/*
+ * Composite wraps ConfigNotify around us and reallocates the window
+ * pixmap once we return. A window resized twice within
+ * WLGLAMOR_RESIZE_SETTLE ms is being dragged: note it so the backing
+ * pixmap allocated next gets headroom. The block handler forgets it if
+ * no such allocation follows.
+ */
+static int
+wlglamor_config_notify (WindowPtr window, int x, int y, int w, int h,
+			int bw, WindowPtr sib)
+{
+  ScreenPtr screen = window->drawable.pScreen;
+  struct wlglamor_device *wlglamor = wlglamor_screen_priv (screen);
+  struct wlglamor_window *priv = wlglamor_window_priv (window);
+  Bool resizing = FALSE;
+  int ret = Success;
+
+  if (w != window->drawable.width || h != window->drawable.height)
+    {
+      resizing = wlglamor_window_resizing (window);
+      priv->last_resize = GetTimeInMillis ();
+    }
+  if (resizing && !priv->id)
+    priv->id = ++wlglamor->window_id;
+  wlglamor->resizing_window = resizing ? priv->id : 0;
+
+  if (wlglamor->ConfigNotify)
+    {
+      screen->ConfigNotify = wlglamor->ConfigNotify;
+      ret = (*screen->ConfigNotify) (window, x, y, w, h, bw, sib);
+      wlglamor->ConfigNotify = screen->ConfigNotify;
+      screen->ConfigNotify = wlglamor_config_notify;
+    }
+
+  return ret;
+}
+
+/* Buffer age as in EGL_EXT_buffer_age: 1 if the buffer holds the frame on
+ * screen, n if it holds the one n - 1 swaps before, 0 if undefined. It is
+ * reported to the client in the DRI2 buffer flags. */
+static void
+wlglamor_dri2_update_age (DrawablePtr drawable, BufferPtr buffer)
+{
+  struct dri2_buffer_priv *private = buffer->driverPrivate;
+  unsigned int frame;
+
+  if (drawable->type != DRAWABLE_WINDOW || private->frame == 0)
+    {
+      buffer->flags = 0;
+      return;
+    }
+
+  frame = *wlglamor_window_frame ((WindowPtr) drawable);
+  buffer->flags = frame - private->frame + 1;
+}
+
+
+static PixmapPtr
+get_drawable_pixmap (DrawablePtr drawable)
+{
+  if (drawable->type == DRAWABLE_PIXMAP)
+    return (PixmapPtr) drawable;
+  else
+    return (*drawable->pScreen->GetWindowPixmap) ((WindowPtr) drawable);
+}
+
+
+/* Mapping a BO waits for the GPU, which has to have been handed X's
+ * rendering first. Only needed once something was drawn since. */
+static void
+wlglamor_flush_rendering (ScreenPtr screen)
+{
+  struct wlglamor_device *wlglamor = wlglamor_screen_priv (screen);
+
+  if (!wlglamor->unflushed)
+    return;
+  glamor_block_handler (screen);
+  wlglamor->unflushed = FALSE;
+}
+
+/*
+ * Read part of a BO backed pixmap, x and y in pixmap coordinates, as a
+ * ZPixmap image through a CPU mapping of the BO. gbm_bo_map hands back a
+ * linear view whatever the layout of the BO: whether it maps it in place
+ * or copies it to a staging buffer first is up to the driver, and this
+ * gbm has no way to ask. Either is cheaper than a glamor readback into a
+ * temporary texture. The mapping is not kept, as it may be a copy.
+ */
+Bool
+wlglamor_pixmap_read (PixmapPtr pixmap, int x, int y, int w, int h,
+		      char *dst)
+{
+#ifdef HAVE_GBM_BO_MAP
+  struct wlglamor_pixmap *priv;
+  int cpp = pixmap->drawable.bitsPerPixel / 8;
+  int dst_stride = PixmapBytePad (w, pixmap->drawable.depth);
+  void *map_data = NULL;
+  uint32_t stride;
+  char *src;
+  int i;
+
+  priv = dixLookupPrivate (&pixmap->devPrivates, wlglamor_pixmap_private_key);
+  if (!priv || !priv->bo || cpp < 2 || w <= 0 || h <= 0)
+    return FALSE;
+
+  wlglamor_flush_rendering (pixmap->drawable.pScreen);
+
+  src = gbm_bo_map (priv->bo, x, y, w, h, GBM_BO_TRANSFER_READ, &stride,
+		    &map_data);
+  if (!src)
+    return FALSE;
+  for (i = 0; i < h; i++)
+    memcpy (dst + i * dst_stride, src + i * stride, w * cpp);
+  gbm_bo_unmap (priv->bo, map_data);
+  return TRUE;
+#else
+  return FALSE;
+#endif
+}
+
+static PixmapPtr
+fixup_glamor (DrawablePtr drawable, PixmapPtr pixmap)
+{
+  PixmapPtr old = get_drawable_pixmap (drawable);
+  ScreenPtr screen = drawable->pScreen;
+  ScrnInfoPtr scrn = xf86ScreenToScrn (screen);
+  struct wlglamor_device *wlglamor = wlglamor_screen_priv (screen);
+  struct wlglamor_pixmap *priv =
+    dixLookupPrivate (&pixmap->devPrivates, wlglamor_pixmap_private_key);
+  struct wlglamor_pixmap *old_priv =
+    dixLookupPrivate (&old->devPrivates, wlglamor_pixmap_private_key);
+  GCPtr gc;
+
+  /* With a glamor pixmap, 2D pixmaps are created in texture
+   * and without a static BO attached to it. To support DRI,
+   * we need to create a new textured-drm pixmap and
+   * need to copy the original content to this new textured-drm
+   * pixmap, and then convert the old pixmap to a coherent
+   * textured-drm pixmap which has a valid BO attached to it
+   * and also has a valid texture, thus both glamor and DRI2
+   * can access it.
+   *
+   */
+
+  /* A BO glamor_egl could not texture has nothing to exchange */
+  if (!wlglamor_depth_is_textured (pixmap->drawable.depth))
+    return NULL;
+
+  /* Copy the current contents of the pixmap to the bo. */
+  gc = GetScratchGC (drawable->depth, screen);
+
+  if (gc)
+    {
+      ValidateGC (&pixmap->drawable, gc);
+
+      gc->ops->CopyArea (&old->drawable, &pixmap->drawable,
+			 gc,
+			 0, 0,
+			 old->drawable.width, old->drawable.height, 0, 0);
+      FreeScratchGC (gc);
+    }
+
+  dixSetPrivate (&pixmap->devPrivates, wlglamor_pixmap_private_key, NULL);
+
+  /* And redirect the pixmap to the new bo (for 3D). */
+  glamor_egl_exchange_buffers(old, pixmap);
+  dixSetPrivate (&old->devPrivates, wlglamor_pixmap_private_key, priv);
+  priv->pixmap = old;
+  old->refcnt++;
+  screen->DestroyPixmap (pixmap);
+
+  /* The texture of a userptr shm pixmap went away with pixmap, the GEM
+   * object can follow */
+  if (old_priv)
+    {
+      if (old_priv->userptr)
+	wlglamor_gem_close (wlglamor->fd, old_priv->userptr);
+      xorg_list_del (&old_priv->link);
+      free (old_priv);
+    }
+
+  screen->ModifyPixmapHeader (old,
+			      old->drawable.width,
+			      old->drawable.height,
+			      0, 0, gbm_bo_get_stride (priv->bo), NULL);
+  return old;
+}
+
+struct gbm_bo *
+wlglamor_get_pixmap_bo (PixmapPtr pixmap)
+{
+  struct wlglamor_pixmap *priv;
+
+  priv = dixLookupPrivate (&pixmap->devPrivates, wlglamor_pixmap_private_key);
+  if (!priv)
+    return NULL;
+
+  return priv->bo;
+}
+
+/*
+ * All BOs use the layout implied by the usage flags.  Every BO goes
+ * through glamor_egl_create_textured_pixmap and, for windows and DRI2,
+ * out as a flink name over wl_drm; neither path carries a format
+ * modifier, so only layouts the kernel records with the object (like
+ * tiling) survive the trip.  Explicit modifiers would have to wait for
+ * a dma-buf based import and linux-dmabuf in the xwayland server.
+ */
+struct gbm_bo *
+wlglamor_bo_create (struct wlglamor_device *wlglamor, int w, int h,
+		    int depth, uint32_t flags)
+{
+  struct gbm_bo *bo;
+
+  bo = gbm_bo_create (wlglamor->gbm, w, h,
+		      wlglamor_gbm_format_for_depth (depth), flags);
+  if (!bo && wlglamor->num_deferred_destroy)
+    {
+      /* Out of memory maybe, give back what is waiting to be freed */
+      wlglamor_drain_deferred_destroy (wlglamor);
+      bo = gbm_bo_create (wlglamor->gbm, w, h,
+			  wlglamor_gbm_format_for_depth (depth), flags);
+    }
+  if (!bo)
+    return NULL;
+
+  wlglamor->bo_bytes += wlglamor_bo_size (bo);
+  if (wlglamor_over_budget (wlglamor))
+    wlglamor->trim_pending = TRUE;
+
+  return bo;
+}
+
+void
+wlglamor_bo_destroy (struct wlglamor_device *wlglamor, struct gbm_bo *bo)
+{
+  wlglamor->bo_bytes -= wlglamor_bo_size (bo);
+  gbm_bo_destroy (bo);
+}
+
+/*
+ * BO memory is accounted to the client whose request allocated it, so
+ * that one client cannot take all of it. CreatePixmap is not told which
+ * client it works for: the XACE dispatch hooks note it for each request,
+ * and the audit hook forgets it once the request is done, so that what
+ * the server allocates for itself in between is not charged. Pixmaps
+ * can outlive their client, the generation tells whether the charge
+ * still belongs to the client now at that index.
+ */
+static void
+wlglamor_dispatch_callback (CallbackListPtr * list, pointer user_data,
+			    pointer call_data)
+{
+  struct wlglamor_device *wlglamor = user_data;
+  XaceCoreDispatchRec *rec = call_data;
+
+  wlglamor->current_client = rec->client;
+}
+
+static void
+wlglamor_ext_dispatch_callback (CallbackListPtr * list, pointer user_data,
+				pointer call_data)
+{
+  struct wlglamor_device *wlglamor = user_data;
+  XaceExtAccessRec *rec = call_data;
+
+  wlglamor->current_client = rec->client;
+}
+
+static void
+wlglamor_audit_end_callback (CallbackListPtr * list, pointer user_data,
+			     pointer call_data)
+{
+  struct wlglamor_device *wlglamor = user_data;
+
+  wlglamor->current_client = NULL;
+}
+
+static void
+wlglamor_client_state_callback (CallbackListPtr * list, pointer user_data,
+				pointer call_data)
+{
+  struct wlglamor_device *wlglamor = user_data;
+  ClientPtr client = ((NewClientInfoRec *) call_data)->client;
+  struct wlglamor_client_usage *usage = &wlglamor->client_usage[client->index];
+
+  if (client->clientState != ClientStateGone)
+    return;
+
+  if (usage->peak)
+    xf86DrvMsgVerb (wlglamor->scrn_index, X_INFO, 3,
+		    "Client %d (pid %d, %s) used up to %llu KiB of BOs\n",
+		    client->index, (int) GetClientPid (client),
+		    GetClientCmdName (client) ? GetClientCmdName (client) : "?",
+		    (unsigned long long) (usage->peak >> 10));
+
+  usage->generation++;
+  usage->bytes = usage->peak = 0;
+  usage->over_soft_limit = FALSE;
+  if (wlglamor->current_client == client)
+    wlglamor->current_client = NULL;
+}
+
+static Bool
+wlglamor_client_accounting_init (struct wlglamor_device *wlglamor)
+{
+  return XaceRegisterCallback (XACE_CORE_DISPATCH,
+			       wlglamor_dispatch_callback, wlglamor) &&
+    XaceRegisterCallback (XACE_EXT_DISPATCH,
+			  wlglamor_ext_dispatch_callback, wlglamor) &&
+    XaceRegisterCallback (XACE_AUDIT_END,
+			  wlglamor_audit_end_callback, wlglamor) &&
+    AddCallback (&ClientStateCallback, wlglamor_client_state_callback,
+		 wlglamor);
+}
+
+static void
+wlglamor_client_accounting_fini (struct wlglamor_device *wlglamor)
+{
+  XaceDeleteCallback (XACE_CORE_DISPATCH, wlglamor_dispatch_callback,
+		      wlglamor);
+  XaceDeleteCallback (XACE_EXT_DISPATCH, wlglamor_ext_dispatch_callback,
+		      wlglamor);
+  XaceDeleteCallback (XACE_AUDIT_END, wlglamor_audit_end_callback, wlglamor);
+  DeleteCallback (&ClientStateCallback, wlglamor_client_state_callback,
+		  wlglamor);
+  wlglamor->current_client = NULL;
+}
+
+/* Index of the client to charge, 0 when the server allocates for itself */
+static int
+wlglamor_current_client (struct wlglamor_device *wlglamor)
+{
+  return wlglamor->current_client ? wlglamor->current_client->index : 0;
+}
+
+void
+wlglamor_pixmap_charge (struct wlglamor_device *wlglamor,
+			struct wlglamor_pixmap *priv)
+{
+  struct wlglamor_client_usage *usage = &wlglamor->client_usage[priv->client];
+
+  if (!priv->client || priv->charged ||
+      usage->generation != priv->client_generation)
+    return;
+
+  priv->charged = wlglamor_bo_size (priv->bo);
+  usage->bytes += priv->charged;
+  usage->peak = max (usage->peak, usage->bytes);
+}
+
+void
+wlglamor_pixmap_uncharge (struct wlglamor_device *wlglamor,
+			  struct wlglamor_pixmap *priv)
+{
+  struct wlglamor_client_usage *usage = &wlglamor->client_usage[priv->client];
+
+  if (priv->charged && usage->generation == priv->client_generation)
+    usage->bytes -= priv->charged;
+  priv->charged = 0;
+}
+
+/* Soft limit: the current client's offscreen pixmaps go to system memory.
+ * Hard limit: its BO allocations fail. */
+static Bool
+wlglamor_client_over_limit (struct wlglamor_device *wlglamor,
+			    uint64_t size, Bool hard)
+{
+  int client = wlglamor_current_client (wlglamor);
+  struct wlglamor_client_usage *usage = &wlglamor->client_usage[client];
+  uint64_t limit = hard ? wlglamor->client_hard_limit :
+    wlglamor->client_soft_limit;
+
+  if (!client || !limit || usage->bytes + size <= limit)
+    {
+      if (!hard)
+	usage->over_soft_limit = FALSE;
+      return FALSE;
+    }
+
+  if (hard)
+    xf86DrvMsg (wlglamor->scrn_index, X_WARNING,
+		"Client %d (pid %d) refused %llu KiB, %llu KiB in use\n",
+		client, (int) GetClientPid (wlglamor->current_client),
+		(unsigned long long) (size >> 10),
+		(unsigned long long) (usage->bytes >> 10));
+  else if (!usage->over_soft_limit)
+    {
+      xf86DrvMsg (wlglamor->scrn_index, X_WARNING,
+		  "Client %d (pid %d) over its soft limit with %llu KiB, "
+		  "using system memory\n",
+		  client, (int) GetClientPid (wlglamor->current_client),
+		  (unsigned long long) (usage->bytes >> 10));
+      usage->over_soft_limit = TRUE;
+    }
+  return TRUE;
+}
+
+/*
+ * Drivers with strict size or format limits fail the same allocations
+ * over and over, and each attempt goes down to the kernel. Remember what
+ * failed for a while: a request of the same size, depth and usage goes
+ * straight to the fallback. Only offscreen pixmaps are cached, a window
+ * or an exported buffer is worth another try.
+ */
+Bool
+wlglamor_alloc_known_bad (struct wlglamor_device *wlglamor, int w, int h,
+			  int depth, uint32_t flags)
+{
+  CARD32 now = GetTimeInMillis ();
+  int i;
+
+  for (i = 0; i < WLGLAMOR_ALLOC_FAILURES_MAX; i++)
+    {
+      struct wlglamor_alloc_failure *failure = &wlglamor->alloc_failures[i];
+
+      if (!failure->time ||
+	  (CARD32) (now - failure->time) >= WLGLAMOR_ALLOC_FAILURE_TIMEOUT)
+	continue;
+      if (failure->depth == depth && failure->flags == flags &&
+	  failure->width == w && failure->height == h)
+	{
+	  wlglamor->num_alloc_failure_hits++;
+	  return TRUE;
+	}
+    }
+
+  return FALSE;
+}
+
+void
+wlglamor_alloc_failed (struct wlglamor_device *wlglamor, int w, int h,
+		       int depth, uint32_t flags)
+{
+  struct wlglamor_alloc_failure *failure;
+
+  failure = &wlglamor->alloc_failures[wlglamor->alloc_failure_next];
+  wlglamor->alloc_failure_next = (wlglamor->alloc_failure_next + 1) %
+    WLGLAMOR_ALLOC_FAILURES_MAX;
+  failure->width = w;
+  failure->height = h;
+  failure->depth = depth;
+  failure->flags = flags;
+  failure->time = GetTimeInMillis () | 1;	/* 0 is an empty slot */
+  wlglamor->num_alloc_failures++;
+}
+
+static int
+wlglamor_round_up (int v, int step)
+{
+  return (v + step - 1) / step * step;
+}
+
+/*
+ * While a window is resized interactively, composite replaces its pixmap
+ * at every motion step. Its BO is allocated with headroom instead, and
+ * when the pixmap is freed the BO waits in a small pool for the next
+ * step of the same window, which takes it back as long as the new size
+ * fits. Only BOs that never reached the compositor are pooled: xwayland
+ * does not tell us when it releases a buffer. They are matched on a
+ * window id that, unlike the XID, is never reused.
+ */
+static struct gbm_bo *
+wlglamor_resize_bo_get (struct wlglamor_device *wlglamor, unsigned int window,
+			int w, int h, int depth, uint32_t flags)
+{
+  int i;
+
+  for (i = 0; i < wlglamor->num_resize_pool; i++)
+    {
+      struct wlglamor_resize_bo *entry = &wlglamor->resize_pool[i];
+      struct gbm_bo *bo = entry->bo;
+
+      if (entry->window != window || entry->depth != depth ||
+	  gbm_bo_get_width (bo) < w || gbm_bo_get_height (bo) < h)
+	continue;
+
+      *entry = wlglamor->resize_pool[--wlglamor->num_resize_pool];
+      return bo;
+    }
+
+  return wlglamor_bo_create (wlglamor,
+			     wlglamor_round_up (w, WLGLAMOR_RESIZE_STEP),
+			     wlglamor_round_up (h, WLGLAMOR_RESIZE_STEP),
+			     depth, flags);
+}
+
+static void
+wlglamor_resize_bo_put (struct wlglamor_device *wlglamor, unsigned int window,
+			struct gbm_bo *bo, int depth)
+{
+  struct wlglamor_resize_bo *entry;
+
+  if (wlglamor->num_resize_pool == WLGLAMOR_RESIZE_POOL_MAX)
+    {
+      /* The oldest is least likely to fit */
+      wlglamor_bo_destroy (wlglamor, wlglamor->resize_pool[0].bo);
+      memmove (&wlglamor->resize_pool[0], &wlglamor->resize_pool[1],
+	       --wlglamor->num_resize_pool * sizeof (*entry));
+    }
+
+  entry = &wlglamor->resize_pool[wlglamor->num_resize_pool++];
+  entry->bo = bo;
+  entry->window = window;
+  entry->depth = depth;
+  entry->time = GetTimeInMillis ();
+}
+
+/* Free the pooled BOs once resizing has settled, or all of them */
+static void
+wlglamor_resize_pool_expire (struct wlglamor_device *wlglamor, Bool all)
+{
+  CARD32 now = GetTimeInMillis ();
+  int i, n = 0;
+
+  for (i = 0; i < wlglamor->num_resize_pool; i++)
+    {
+      struct wlglamor_resize_bo *entry = &wlglamor->resize_pool[i];
+
+      if (all || (CARD32) (now - entry->time) >= WLGLAMOR_RESIZE_SETTLE)
+	wlglamor_bo_destroy (wlglamor, entry->bo);
+      else
+	wlglamor->resize_pool[n++] = *entry;
+    }
+  wlglamor->num_resize_pool = n;
+}
+
+/* A bare pixmap, not known to the rest of the driver, textured from bo */
+PixmapPtr
+wlglamor_bo_pixmap (ScreenPtr screen, struct gbm_bo *bo, int w, int h,
+		    int depth)
+{
+  union gbm_bo_handle handle = gbm_bo_get_handle (bo);
+  PixmapPtr pixmap;
+
+  pixmap = fbCreatePixmap (screen, 0, 0, depth, 0);
+  if (pixmap == NullPixmap)
+    return NULL;
+
+  screen->ModifyPixmapHeader (pixmap, w, h, 0, 0, gbm_bo_get_stride (bo),
+			      NULL);
+  if (!glamor_egl_create_textured_pixmap (pixmap, handle.u32,
+					  gbm_bo_get_stride (bo)))
+    {
+      fbDestroyPixmap (pixmap);
+      return NULL;
+    }
+
+  return pixmap;
+}
+
+void
+wlglamor_bo_pixmap_destroy (PixmapPtr pixmap)
+{
+  glamor_egl_destroy_textured_pixmap (pixmap);
+  fbDestroyPixmap (pixmap);
+}
+
+/*
+ * In rootless mode top-level windows have buffers of their own and the
+ * root window is never shown, yet the front BO covers the whole virtual
+ * screen. Once nothing has drawn to it for the idle timeout it is freed,
+ * leaving the screen pixmap without storage, and allocated again by the
+ * first access, which all go through the same hooks as demoted pixmaps.
+ * The contents are lost in between: the root window is exposed again.
+ *
+ * glamor_egl keeps the EGLImage of the screen pixmap to itself and
+ * destroys it at CloseScreen, so the front is never left without one:
+ * while released it is a 1x1 pixmap on a placeholder BO. Off unless
+ * ReleaseIdleFront is set.
+ */
+
+/* Move the front onto the storage of tmp, a wlglamor_bo_pixmap, which
+ * takes the old one away with it. glamor_egl_exchange_buffers also hands
+ * over its screen image. */
+static void
+wlglamor_front_exchange (struct wlglamor_device *wlglamor, PixmapPtr tmp)
+{
+  PixmapPtr front = wlglamor->front_pixmap;
+  ScreenPtr screen = front->drawable.pScreen;
+
+  glamor_egl_exchange_buffers (front, tmp);
+  screen->ModifyPixmapHeader (front, tmp->drawable.width,
+			      tmp->drawable.height, 0, 0, tmp->devKind, NULL);
+  front->devPrivate.ptr = NULL;
+  front->drawable.serialNumber = NEXT_SERIAL_NUMBER;
+  wlglamor_bo_pixmap_destroy (tmp);
+}
+
+static Bool
+wlglamor_front_realize (struct wlglamor_device *wlglamor)
+{
+  PixmapPtr front = wlglamor->front_pixmap;
+  ScrnInfoPtr pScrn = xf86ScreenToScrn (front->drawable.pScreen);
+  struct wlglamor_pixmap *priv;
+  struct gbm_bo *bo;
+  PixmapPtr tmp;
+
+  wlglamor->front_last_use = GetTimeInMillis ();
+  if (wlglamor->front_bo)
+    return TRUE;
+
+  bo = wlglamor_bo_create (wlglamor, pScrn->virtualX, pScrn->virtualY,
+			   front->drawable.depth,
+			   GBM_BO_USE_RENDERING | GBM_BO_USE_SCANOUT);
+  if (!bo)
+    return FALSE;
+
+  tmp = wlglamor_bo_pixmap (front->drawable.pScreen, bo, pScrn->virtualX,
+			    pScrn->virtualY, front->drawable.depth);
+  if (!tmp)
+    {
+      wlglamor_bo_destroy (wlglamor, bo);
+      return FALSE;
+    }
+  wlglamor_front_exchange (wlglamor, tmp);
+
+  priv = dixLookupPrivate (&front->devPrivates, wlglamor_pixmap_private_key);
+  wlglamor->front_bo = priv->bo = bo;
+  wlglamor->front_exposed = TRUE;
+  return TRUE;
+}
+
+static void
+wlglamor_front_release (struct wlglamor_device *wlglamor)
+{
+  PixmapPtr front = wlglamor->front_pixmap;
+  struct wlglamor_pixmap *priv;
+  PixmapPtr tmp;
+
+  if (!wlglamor->lazy_front || !wlglamor->front_bo || front->refcnt != 1 ||
+      (CARD32) (GetTimeInMillis () - wlglamor->front_last_use) <
+      wlglamor->idle_timeout)
+    return;
+
+  /* Handed to a DRI2 client, which keeps the name */
+  priv = dixLookupPrivate (&front->devPrivates, wlglamor_pixmap_private_key);
+  if (priv->exported)
+    return;
+
+  if (!wlglamor->front_placeholder)
+    wlglamor->front_placeholder =
+      wlglamor_bo_create (wlglamor, 1, 1, front->drawable.depth,
+			  GBM_BO_USE_RENDERING);
+  if (!wlglamor->front_placeholder)
+    return;
+
+  tmp = wlglamor_bo_pixmap (front->drawable.pScreen,
+			    wlglamor->front_placeholder, 1, 1,
+			    front->drawable.depth);
+  if (!tmp)
+    return;
+
+  wlglamor_front_exchange (wlglamor, tmp);
+  wlglamor_bo_destroy (wlglamor, wlglamor->front_bo);
+  wlglamor->front_bo = priv->bo = NULL;
+}
+
+/* Paint the background of a reallocated front and let clients redraw */
+static void
+wlglamor_front_expose (struct wlglamor_device *wlglamor)
+{
+  ScreenPtr screen = wlglamor->front_pixmap->drawable.pScreen;
+  RegionRec region;
+
+  wlglamor->front_exposed = FALSE;
+  if (!screen->root)
+    return;
+
+  RegionNull (&region);
+  RegionCopy (&region, &screen->root->clipList);
+  (*screen->WindowExposures) (screen->root, &region, NullRegion);
+  RegionUninit (&region);
+}
+
+/* DRI2 clients drawing to windows on the front hold the name of its BO */
+static int
+wlglamor_front_invalidate (WindowPtr window, pointer data)
+{
+  ScreenPtr screen = window->drawable.pScreen;
+
+  if ((*screen->GetWindowPixmap) (window) == data)
+    DRI2InvalidateDrawable (&window->drawable);
+  return WT_WALKCHILDREN;
+}
+
+/*
+ * RandR screen resize. xwayland sets up the CRTC configuration from the
+ * compositor's outputs but refuses any size other than the one picked at
+ * pre-init, so the virtual size had to cover the worst case. Here the
+ * front BO is reallocated at the new size and the screen pixmap moved
+ * onto it, its contents carried over with one GPU copy.
+ */
+static Bool
+wlglamor_xf86crtc_resize (ScrnInfoPtr pScrn, int width, int height)
+{
+  ScreenPtr screen = xf86ScrnToScreen (pScrn);
+  struct wlglamor_device *wlglamor = wlglamor_scrninfo_priv (pScrn);
+  PixmapPtr front = wlglamor->front_pixmap;
+  struct wlglamor_pixmap *priv;
+  struct gbm_bo *bo;
+  PixmapPtr tmp;
+  GCPtr gc;
+  int cpp = pScrn->bitsPerPixel / 8;
+
+  if (pScrn->virtualX == width && pScrn->virtualY == height)
+    return TRUE;
+
+  priv = dixLookupPrivate (&front->devPrivates, wlglamor_pixmap_private_key);
+  if (!wlglamor->front_bo)
+    {
+      /* Released, it will be allocated at the new size */
+      pScrn->virtualX = width;
+      pScrn->virtualY = height;
+      pScrn->displayWidth = width;
+      return TRUE;
+    }
+
+  bo = wlglamor_bo_create (wlglamor, width, height, front->drawable.depth,
+			   GBM_BO_USE_RENDERING | GBM_BO_USE_SCANOUT);
+  if (!bo)
+    return FALSE;
+
+  tmp = wlglamor_bo_pixmap (screen, bo, width, height, front->drawable.depth);
+  gc = tmp ? GetScratchGC (front->drawable.depth, screen) : NULL;
+  if (!gc)
+    {
+      if (tmp)
+	wlglamor_bo_pixmap_destroy (tmp);
+      wlglamor_bo_destroy (wlglamor, bo);
+      return FALSE;
+    }
+
+  ValidateGC (&tmp->drawable, gc);
+  gc->ops->CopyArea (&front->drawable, &tmp->drawable, gc, 0, 0,
+		     min (width, pScrn->virtualX),
+		     min (height, pScrn->virtualY), 0, 0);
+  FreeScratchGC (gc);
+
+  wlglamor_front_exchange (wlglamor, tmp);
+  wlglamor_bo_destroy (wlglamor, wlglamor->front_bo);
+  wlglamor->front_bo = priv->bo = bo;
+
+  pScrn->virtualX = width;
+  pScrn->virtualY = height;
+  pScrn->displayWidth = front->devKind / cpp;
+
+  if (screen->root)
+    TraverseTree (screen->root, wlglamor_front_invalidate, front);
+  return TRUE;
+}
+
+/* The GPU is about to use the pixmap. FALSE if it has no storage. */
+static Bool
+wlglamor_pixmap_use (PixmapPtr pixmap)
+{
+  struct wlglamor_device *wlglamor;
+  struct wlglamor_pixmap *priv;
+
+  wlglamor = wlglamor_screen_priv (pixmap->drawable.pScreen);
+  if (pixmap == wlglamor->front_pixmap && wlglamor->lazy_front)
+    {
+      /* Nothing can be drawn without it, the request is dropped */
+      return wlglamor_front_realize (wlglamor);
+    }
+
+  priv = dixLookupPrivate (&pixmap->devPrivates, wlglamor_pixmap_private_key);
+  if (!priv || priv->exported)
+    return TRUE;
+
+  /* Left to glamor's memory pixmap path until the block handler uploads
+   * it, the allocation that just failed is unlikely to work right now */
+  if (priv->fallback)
+    {
+      if (xorg_list_is_empty (&priv->link))
+	xorg_list_append (&priv->link, &wlglamor->fallback_pixmaps);
+      return TRUE;
+    }
+
+  /* Nothing can render from or into a cold pixmap */
+  if (priv->cold && !wlglamor_pixmap_thaw (pixmap))
+    return FALSE;
+
+  if (priv->sysmem && wlglamor_pixmap_promote (pixmap))
+    return TRUE;
+  wlglamor_pixmap_touch (wlglamor, priv);
+  return TRUE;
+}
+
+/* The GPU is about to render into the pixmap */
+static Bool
+wlglamor_pixmap_write (PixmapPtr pixmap)
+{
+  struct wlglamor_device *wlglamor =
+    wlglamor_screen_priv (pixmap->drawable.pScreen);
+  struct wlglamor_pixmap *priv;
+
+  if (!wlglamor_pixmap_use (pixmap))
+    return FALSE;
+  wlglamor->unflushed = TRUE;
+
+  priv = dixLookupPrivate (&pixmap->devPrivates, wlglamor_pixmap_private_key);
+  if (!priv)
+    return TRUE;
+  if (priv->userptr && xorg_list_is_empty (&priv->link))
+    xorg_list_append (&priv->link, &wlglamor->shm_pixmaps);
+  priv->last_write = GetTimeInMillis ();
+  priv->hashed = FALSE;
+  /* Drawing into a BO other pixmaps share would change them all */
+  return wlglamor_pixmap_own (pixmap);
+}
+
+static Bool
+wlglamor_drawable_use (DrawablePtr drawable)
+{
+  return wlglamor_pixmap_use (get_drawable_pixmap (drawable));
+}
+
+static Bool
+wlglamor_drawable_write (DrawablePtr drawable)
+{
+  return wlglamor_pixmap_write (get_drawable_pixmap (drawable));
+}
+
+/* Render reads and writes the alpha map along with the picture */
+static Bool
+wlglamor_picture_use (PicturePtr picture)
+{
+  if (!picture)
+    return TRUE;
+  if (picture->alphaMap && !wlglamor_picture_use (picture->alphaMap))
+    return FALSE;
+  return !picture->pDrawable || wlglamor_drawable_use (picture->pDrawable);
+}
+
+static Bool
+wlglamor_picture_write (PicturePtr picture)
+{
+  if (picture->alphaMap && !wlglamor_picture_write (picture->alphaMap))
+    return FALSE;
+  return !picture->pDrawable || wlglamor_drawable_write (picture->pDrawable);
+}
+
+/* The pixmap is being handed out, keep it on the GPU from now on */
+static Bool
+wlglamor_pixmap_export (PixmapPtr pixmap)
+{
+  struct wlglamor_device *wlglamor;
+  struct wlglamor_pixmap *priv;
+
+  priv = dixLookupPrivate (&pixmap->devPrivates, wlglamor_pixmap_private_key);
+  if (!priv)
+    return TRUE;
+
+  wlglamor = wlglamor_screen_priv (pixmap->drawable.pScreen);
+  if (pixmap == wlglamor->front_pixmap && wlglamor->lazy_front &&
+      !wlglamor_front_realize (wlglamor))
+    return FALSE;
+  if (!wlglamor_pixmap_promote (pixmap) || !wlglamor_pixmap_own (pixmap))
+    return FALSE;
+
+  priv->exported = TRUE;
+  xorg_list_del (&priv->link);
+  return TRUE;
+}
+
+struct wlglamor_gc
+{
+  const GCFuncs *funcs;
+  const GCOps *ops;		/* NULL until the GC is first validated */
+  unsigned long changes;	/* held back, the tile or stipple is cold */
+  Bool unvalidated;
+};
+
+static const GCFuncs wlglamor_gc_funcs;
+static const GCOps wlglamor_gc_ops;
+
+#define WLGLAMOR_GC_UNWRAP(gc) \
+  struct wlglamor_gc *gc_priv = \
+    dixGetPrivateAddr (&(gc)->devPrivates, wlglamor_gc_private_key); \
+  (gc)->funcs = gc_priv->funcs; \
+  if (gc_priv->ops) \
+    (gc)->ops = gc_priv->ops
+
+#define WLGLAMOR_GC_WRAP(gc) \
+  gc_priv->funcs = (gc)->funcs; \
+  (gc)->funcs = &wlglamor_gc_funcs; \
+  if (gc_priv->ops) \
+    { \
+      gc_priv->ops = (gc)->ops; \
+      (gc)->ops = &wlglamor_gc_ops; \
+    }
+
+/*
+ * A GC is only validated when it or the drawable's serial number
+ * changed, so drawing is tracked in the ops below. fb reads the tile and
+ * stipple of the GC here already: if one of them cannot be restored, the
+ * validation waits and the ops draw nothing until it went through.
+ */
+static void
+wlglamor_validate_gc (GCPtr gc, unsigned long changes, DrawablePtr drawable)
+{
+  WLGLAMOR_GC_UNWRAP (gc);
+  changes |= gc_priv->changes;
+  if ((gc->tileIsPixel || !gc->tile.pixmap ||
+       wlglamor_pixmap_use (gc->tile.pixmap)) &&
+      (!gc->stipple || wlglamor_pixmap_use (gc->stipple)))
+    {
+      (*gc->funcs->ValidateGC) (gc, changes, drawable);
+      gc_priv->changes = 0;
+      gc_priv->unvalidated = FALSE;
+    }
+  else
+    {
+      gc_priv->changes = changes;
+      gc_priv->unvalidated = TRUE;
+    }
+  gc_priv->ops = gc->ops;
+  WLGLAMOR_GC_WRAP (gc);
+}
+
+static void
+wlglamor_change_gc (GCPtr gc, unsigned long mask)
+{
+  WLGLAMOR_GC_UNWRAP (gc);
+  (*gc->funcs->ChangeGC) (gc, mask);
+  WLGLAMOR_GC_WRAP (gc);
+}
+
+static void
+wlglamor_copy_gc (GCPtr src, unsigned long mask, GCPtr dst)
+{
+  WLGLAMOR_GC_UNWRAP (dst);
+  (*dst->funcs->CopyGC) (src, mask, dst);
+  WLGLAMOR_GC_WRAP (dst);
+}
+
+static void
+wlglamor_destroy_gc (GCPtr gc)
+{
+  WLGLAMOR_GC_UNWRAP (gc);
+  (*gc->funcs->DestroyGC) (gc);
+  WLGLAMOR_GC_WRAP (gc);
+}
+
+static void
+wlglamor_change_clip (GCPtr gc, int type, pointer value, int nrects)
+{
+  WLGLAMOR_GC_UNWRAP (gc);
+  (*gc->funcs->ChangeClip) (gc, type, value, nrects);
+  WLGLAMOR_GC_WRAP (gc);
+}
+
+static void
+wlglamor_destroy_clip (GCPtr gc)
+{
+  WLGLAMOR_GC_UNWRAP (gc);
+  (*gc->funcs->DestroyClip) (gc);
+  WLGLAMOR_GC_WRAP (gc);
+}
+
+static void
+wlglamor_copy_clip (GCPtr dst, GCPtr src)
+{
+  WLGLAMOR_GC_UNWRAP (dst);
+  (*dst->funcs->CopyClip) (dst, src);
+  WLGLAMOR_GC_WRAP (dst);
+}
+
+static const GCFuncs wlglamor_gc_funcs = {
+  wlglamor_validate_gc,
+  wlglamor_change_gc,
+  wlglamor_copy_gc,
+  wlglamor_destroy_gc,
+  wlglamor_change_clip,
+  wlglamor_destroy_clip,
+  wlglamor_copy_clip
+};
+
+/* The ops may validate the GC again, so the funcs are unwrapped too */
+#define WLGLAMOR_GC_OP_UNWRAP(gc) \
+  struct wlglamor_gc *gc_priv = \
+    dixGetPrivateAddr (&(gc)->devPrivates, wlglamor_gc_private_key); \
+  const GCFuncs *op_funcs = (gc)->funcs; \
+  (gc)->funcs = gc_priv->funcs; \
+  (gc)->ops = gc_priv->ops
+
+#define WLGLAMOR_GC_OP_WRAP(gc) \
+  gc_priv->funcs = (gc)->funcs; \
+  (gc)->funcs = op_funcs; \
+  gc_priv->ops = (gc)->ops; \
+  (gc)->ops = &wlglamor_gc_ops
+
+/* Whether an op can go ahead, with src (if any) and dst given storage */
+static Bool
+wlglamor_gc_op_prepare (GCPtr gc, struct wlglamor_gc *gc_priv,
+			DrawablePtr src, DrawablePtr dst)
+{
+  if (gc_priv->unvalidated)
+    {
+      /* Have the next request validate it again */
+      gc->serialNumber |= GC_CHANGE_SERIAL_BIT;
+      return FALSE;
+    }
+  return (!src || wlglamor_drawable_use (src)) &&
+    wlglamor_drawable_write (dst);
+}
+
+static void
+wlglamor_fill_spans (DrawablePtr drawable, GCPtr gc, int n,
+		     DDXPointPtr points, int *widths, int sorted)
+{
+  WLGLAMOR_GC_OP_UNWRAP (gc);
+  if (wlglamor_gc_op_prepare (gc, gc_priv, NULL, drawable))
+    (*gc->ops->FillSpans) (drawable, gc, n, points, widths, sorted);
+  WLGLAMOR_GC_OP_WRAP (gc);
+}
+
+static void
+wlglamor_set_spans (DrawablePtr drawable, GCPtr gc, char *src,
+		    DDXPointPtr points, int *widths, int n, int sorted)
+{
+  WLGLAMOR_GC_OP_UNWRAP (gc);
+  if (wlglamor_gc_op_prepare (gc, gc_priv, NULL, drawable))
+    (*gc->ops->SetSpans) (drawable, gc, src, points, widths, n, sorted);
+  WLGLAMOR_GC_OP_WRAP (gc);
+}
+
+static void
+wlglamor_put_image (DrawablePtr drawable, GCPtr gc, int depth, int x, int y,
+		    int w, int h, int left_pad, int format, char *bits)
+{
+  WLGLAMOR_GC_OP_UNWRAP (gc);
+  if (wlglamor_gc_op_prepare (gc, gc_priv, NULL, drawable))
+    (*gc->ops->PutImage) (drawable, gc, depth, x, y, w, h, left_pad,
+			  format, bits);
+  WLGLAMOR_GC_OP_WRAP (gc);
+}
+
+static RegionPtr
+wlglamor_copy_area (DrawablePtr src, DrawablePtr dst, GCPtr gc,
+		    int src_x, int src_y, int w, int h, int dst_x, int dst_y)
+{
+  RegionPtr ret = NULL;
+
+  WLGLAMOR_GC_OP_UNWRAP (gc);
+  if (wlglamor_gc_op_prepare (gc, gc_priv, src, dst))
+    ret = (*gc->ops->CopyArea) (src, dst, gc, src_x, src_y, w, h,
+				dst_x, dst_y);
+  WLGLAMOR_GC_OP_WRAP (gc);
+  return ret;
+}
+
+static RegionPtr
+wlglamor_copy_plane (DrawablePtr src, DrawablePtr dst, GCPtr gc,
+		     int src_x, int src_y, int w, int h, int dst_x, int dst_y,
+		     unsigned long plane)
+{
+  RegionPtr ret = NULL;
+
+  WLGLAMOR_GC_OP_UNWRAP (gc);
+  if (wlglamor_gc_op_prepare (gc, gc_priv, src, dst))
+    ret = (*gc->ops->CopyPlane) (src, dst, gc, src_x, src_y, w, h,
+				 dst_x, dst_y, plane);
+  WLGLAMOR_GC_OP_WRAP (gc);
+  return ret;
+}
+
+static void
+wlglamor_poly_point (DrawablePtr drawable, GCPtr gc, int mode, int n,
+		     DDXPointPtr points)
+{
+  WLGLAMOR_GC_OP_UNWRAP (gc);
+  if (wlglamor_gc_op_prepare (gc, gc_priv, NULL, drawable))
+    (*gc->ops->PolyPoint) (drawable, gc, mode, n, points);
+  WLGLAMOR_GC_OP_WRAP (gc);
+}
+
+static void
+wlglamor_poly_lines (DrawablePtr drawable, GCPtr gc, int mode, int n,
+		     DDXPointPtr points)
+{
+  WLGLAMOR_GC_OP_UNWRAP (gc);
+  if (wlglamor_gc_op_prepare (gc, gc_priv, NULL, drawable))
+    (*gc->ops->Polylines) (drawable, gc, mode, n, points);
+  WLGLAMOR_GC_OP_WRAP (gc);
+}
+
+static void
+wlglamor_poly_segment (DrawablePtr drawable, GCPtr gc, int n,
+		       xSegment * segs)
+{
+  WLGLAMOR_GC_OP_UNWRAP (gc);
+  if (wlglamor_gc_op_prepare (gc, gc_priv, NULL, drawable))
+    (*gc->ops->PolySegment) (drawable, gc, n, segs);
+  WLGLAMOR_GC_OP_WRAP (gc);
+}
+
+static void
+wlglamor_poly_rectangle (DrawablePtr drawable, GCPtr gc, int n,
+			 xRectangle * rects)
+{
+  WLGLAMOR_GC_OP_UNWRAP (gc);
+  if (wlglamor_gc_op_prepare (gc, gc_priv, NULL, drawable))
+    (*gc->ops->PolyRectangle) (drawable, gc, n, rects);
+  WLGLAMOR_GC_OP_WRAP (gc);
+}
+
+static void
+wlglamor_poly_arc (DrawablePtr drawable, GCPtr gc, int n, xArc * arcs)
+{
+  WLGLAMOR_GC_OP_UNWRAP (gc);
+  if (wlglamor_gc_op_prepare (gc, gc_priv, NULL, drawable))
+    (*gc->ops->PolyArc) (drawable, gc, n, arcs);
+  WLGLAMOR_GC_OP_WRAP (gc);
+}
+
+static void
+wlglamor_fill_polygon (DrawablePtr drawable, GCPtr gc, int shape, int mode,
+		       int n, DDXPointPtr points)
+{
+  WLGLAMOR_GC_OP_UNWRAP (gc);
+  if (wlglamor_gc_op_prepare (gc, gc_priv, NULL, drawable))
+    (*gc->ops->FillPolygon) (drawable, gc, shape, mode, n, points);
+  WLGLAMOR_GC_OP_WRAP (gc);
+}
+
+static void
+wlglamor_poly_fill_rect (DrawablePtr drawable, GCPtr gc, int n,
+			 xRectangle * rects)
+{
+  WLGLAMOR_GC_OP_UNWRAP (gc);
+  if (wlglamor_gc_op_prepare (gc, gc_priv, NULL, drawable))
+    (*gc->ops->PolyFillRect) (drawable, gc, n, rects);
+  WLGLAMOR_GC_OP_WRAP (gc);
+}
+
+static void
+wlglamor_poly_fill_arc (DrawablePtr drawable, GCPtr gc, int n, xArc * arcs)
+{
+  WLGLAMOR_GC_OP_UNWRAP (gc);
+  if (wlglamor_gc_op_prepare (gc, gc_priv, NULL, drawable))
+    (*gc->ops->PolyFillArc) (drawable, gc, n, arcs);
+  WLGLAMOR_GC_OP_WRAP (gc);
+}
+
+static int
+wlglamor_poly_text8 (DrawablePtr drawable, GCPtr gc, int x, int y, int n,
+		     char *chars)
+{
+  int ret = x;
+
+  WLGLAMOR_GC_OP_UNWRAP (gc);
+  if (wlglamor_gc_op_prepare (gc, gc_priv, NULL, drawable))
+    ret = (*gc->ops->PolyText8) (drawable, gc, x, y, n, chars);
+  WLGLAMOR_GC_OP_WRAP (gc);
+  return ret;
+}
+
+static int
+wlglamor_poly_text16 (DrawablePtr drawable, GCPtr gc, int x, int y, int n,
+		      unsigned short *chars)
+{
+  int ret = x;
+
+  WLGLAMOR_GC_OP_UNWRAP (gc);
+  if (wlglamor_gc_op_prepare (gc, gc_priv, NULL, drawable))
+    ret = (*gc->ops->PolyText16) (drawable, gc, x, y, n, chars);
+  WLGLAMOR_GC_OP_WRAP (gc);
+  return ret;
+}
+
+static void
+wlglamor_image_text8 (DrawablePtr drawable, GCPtr gc, int x, int y, int n,
+		      char *chars)
+{
+  WLGLAMOR_GC_OP_UNWRAP (gc);
+  if (wlglamor_gc_op_prepare (gc, gc_priv, NULL, drawable))
+    (*gc->ops->ImageText8) (drawable, gc, x, y, n, chars);
+  WLGLAMOR_GC_OP_WRAP (gc);
+}
+
+static void
+wlglamor_image_text16 (DrawablePtr drawable, GCPtr gc, int x, int y, int n,
+		       unsigned short *chars)
+{
+  WLGLAMOR_GC_OP_UNWRAP (gc);
+  if (wlglamor_gc_op_prepare (gc, gc_priv, NULL, drawable))
+    (*gc->ops->ImageText16) (drawable, gc, x, y, n, chars);
+  WLGLAMOR_GC_OP_WRAP (gc);
+}
+
+static void
+wlglamor_image_glyph_blt (DrawablePtr drawable, GCPtr gc, int x, int y,
+			  unsigned int n, CharInfoPtr * glyphs, pointer base)
+{
+  WLGLAMOR_GC_OP_UNWRAP (gc);
+  if (wlglamor_gc_op_prepare (gc, gc_priv, NULL, drawable))
+    (*gc->ops->ImageGlyphBlt) (drawable, gc, x, y, n, glyphs, base);
+  WLGLAMOR_GC_OP_WRAP (gc);
+}
+
+static void
+wlglamor_poly_glyph_blt (DrawablePtr drawable, GCPtr gc, int x, int y,
+			 unsigned int n, CharInfoPtr * glyphs, pointer base)
+{
+  WLGLAMOR_GC_OP_UNWRAP (gc);
+  if (wlglamor_gc_op_prepare (gc, gc_priv, NULL, drawable))
+    (*gc->ops->PolyGlyphBlt) (drawable, gc, x, y, n, glyphs, base);
+  WLGLAMOR_GC_OP_WRAP (gc);
+}
+
+static void
+wlglamor_push_pixels (GCPtr gc, PixmapPtr bitmap, DrawablePtr drawable,
+		      int w, int h, int x, int y)
+{
+  WLGLAMOR_GC_OP_UNWRAP (gc);
+  if (wlglamor_gc_op_prepare (gc, gc_priv, &bitmap->drawable, drawable))
+    (*gc->ops->PushPixels) (gc, bitmap, drawable, w, h, x, y);
+  WLGLAMOR_GC_OP_WRAP (gc);
+}
+
+static const GCOps wlglamor_gc_ops = {
+  wlglamor_fill_spans,
+  wlglamor_set_spans,
+  wlglamor_put_image,
+  wlglamor_copy_area,
+  wlglamor_copy_plane,
+  wlglamor_poly_point,
+  wlglamor_poly_lines,
+  wlglamor_poly_segment,
+  wlglamor_poly_rectangle,
+  wlglamor_poly_arc,
+  wlglamor_fill_polygon,
+  wlglamor_poly_fill_rect,
+  wlglamor_poly_fill_arc,
+  wlglamor_poly_text8,
+  wlglamor_poly_text16,
+  wlglamor_image_text8,
+  wlglamor_image_text16,
+  wlglamor_image_glyph_blt,
+  wlglamor_poly_glyph_blt,
+  wlglamor_push_pixels
+};
+
+static Bool
+wlglamor_create_gc (GCPtr gc)
+{
+  ScreenPtr screen = gc->pScreen;
+  struct wlglamor_device *wlglamor = wlglamor_screen_priv (screen);
+  struct wlglamor_gc *gc_priv;
+  Bool ret;
+
+  screen->CreateGC = wlglamor->CreateGC;
+  ret = (*screen->CreateGC) (gc);
+  wlglamor->CreateGC = screen->CreateGC;
+  screen->CreateGC = wlglamor_create_gc;
+
+  if (ret)
+    {
+      gc_priv = dixGetPrivateAddr (&gc->devPrivates, wlglamor_gc_private_key);
+      gc_priv->funcs = gc->funcs;
+      gc_priv->ops = NULL;
+      gc_priv->changes = 0;
+      gc_priv->unvalidated = FALSE;
+      gc->funcs = &wlglamor_gc_funcs;
+    }
+  return ret;
+}
+
+/* Drawables read outside the GC ops, by mi and composite for instance */
+static void
+wlglamor_source_validate (DrawablePtr drawable, int x, int y,
+			  int width, int height, unsigned int subWindowMode)
+{
+  ScreenPtr screen = drawable->pScreen;
+  struct wlglamor_device *wlglamor = wlglamor_screen_priv (screen);
+
+  wlglamor_drawable_use (drawable);
+
+  if (wlglamor->SourceValidate)
+    {
+      screen->SourceValidate = wlglamor->SourceValidate;
+      (*screen->SourceValidate) (drawable, x, y, width, height,
+				 subWindowMode);
+      wlglamor->SourceValidate = screen->SourceValidate;
+      screen->SourceValidate = wlglamor_source_validate;
+    }
+}
+
+static void
+wlglamor_capture_fini (struct wlglamor_device *wlglamor)
+{
+  if (!wlglamor->capture_pixmap)
+    return;
+  wlglamor_bo_pixmap_destroy (wlglamor->capture_pixmap);
+  wlglamor_bo_destroy (wlglamor, wlglamor->capture_bo);
+  wlglamor->capture_pixmap = NULL;
+  wlglamor->capture_bo = NULL;
+}
+
+/*
+ * GetImage and ShmGetImage on windows are what screen recorders and
+ * remote desktops poll, and window and front BOs are laid out for
+ * scanout. The area is blitted into a linear staging BO, kept for the
+ * next frame, and copied from its mapping straight into the reply or
+ * the shm segment. x and y are in pixmap coordinates.
+ */
+static Bool
+wlglamor_capture_read (PixmapPtr pixmap, int x, int y, int w, int h,
+		       char *dst)
+{
+#if defined(HAVE_GBM_BO_MAP) && HAVE_DECL_GBM_BO_USE_LINEAR
+  ScreenPtr screen = pixmap->drawable.pScreen;
+  struct wlglamor_device *wlglamor = wlglamor_screen_priv (screen);
+  int depth = pixmap->drawable.depth;
+  int cpp = pixmap->drawable.bitsPerPixel / 8;
+  int dst_stride = PixmapBytePad (w, depth);
+  PixmapPtr staging = wlglamor->capture_pixmap;
+  void *map_data = NULL;
+  uint32_t stride;
+  GCPtr gc;
+  char *src;
+  int i;
+
+  if (!wlglamor_depth_is_textured (depth) ||
+      !wlglamor_get_pixmap_bo (pixmap) || w <= 0 || h <= 0)
     return FALSE;
 
-  /* We have to put a valid buffer for the screen pixmap .
-   * For initialization, we have put a buffer outside graphic 
-   * memory. Now we can create pixmaps, we allocate a correct
-   * pixmap for the screen pixmap. */
+  if (staging && (staging->drawable.depth != depth ||
+		  staging->drawable.width < w ||
+		  staging->drawable.height < h))
+    wlglamor_capture_fini (wlglamor);
+  if (!wlglamor->capture_pixmap)
+    {
+      int bw = wlglamor_round_up (w, WLGLAMOR_CAPTURE_STEP);
+      int bh = wlglamor_round_up (h, WLGLAMOR_CAPTURE_STEP);
 
-  wlglamor->front_pixmap = fbCreatePixmap (screen, 0, 0, 24, 0);
-  if (wlglamor->front_pixmap == NullPixmap)
+      wlglamor->capture_bo =
+	wlglamor_bo_create (wlglamor, bw, bh, depth,
+			    GBM_BO_USE_RENDERING | GBM_BO_USE_LINEAR);
+      if (!wlglamor->capture_bo)
+	return FALSE;
+      wlglamor->capture_pixmap =
+	wlglamor_bo_pixmap (screen, wlglamor->capture_bo, bw, bh, depth);
+      if (!wlglamor->capture_pixmap)
+	{
+	  wlglamor_bo_destroy (wlglamor, wlglamor->capture_bo);
+	  wlglamor->capture_bo = NULL;
+	  return FALSE;
+	}
+    }
+  staging = wlglamor->capture_pixmap;
+  wlglamor->capture_last_use = GetTimeInMillis ();
+
+  gc = GetScratchGC (depth, screen);
+  if (!gc)
     return FALSE;
+  ValidateGC (&staging->drawable, gc);
+  gc->ops->CopyArea (&pixmap->drawable, &staging->drawable, gc, x, y, w, h,
+		     0, 0);
+  FreeScratchGC (gc);
+  wlglamor_flush_rendering (screen);
 
-  priv = calloc (1, sizeof (struct wlglamor_pixmap));
-  if (priv == NULL)
+  src = gbm_bo_map (wlglamor->capture_bo, 0, 0, w, h, GBM_BO_TRANSFER_READ,
+		    &stride, &map_data);
+  if (!src)
     return FALSE;
+  for (i = 0; i < h; i++)
+    memcpy (dst + i * dst_stride, src + i * stride, w * cpp);
+  gbm_bo_unmap (wlglamor->capture_bo, map_data);
+  return TRUE;
+#else
+  return FALSE;
+#endif
+}
 
-  priv->bo = wlglamor->front_bo;
-  priv->refcount = 1;
+static void
+wlglamor_get_image (DrawablePtr drawable, int x, int y, int w, int h,
+		    unsigned int format, unsigned long plane_mask, char *d)
+{
+  ScreenPtr screen = drawable->pScreen;
+  struct wlglamor_device *wlglamor = wlglamor_screen_priv (screen);
+  PixmapPtr pixmap = get_drawable_pixmap (drawable);
+  FbBits mask = FbFullMask (drawable->depth);
 
-  dixSetPrivate (&wlglamor->front_pixmap->devPrivates,
-		 wlglamor_pixmap_private_key, priv);
-  screen->ModifyPixmapHeader (wlglamor->front_pixmap,
-			      pScrn->virtualX, pScrn->virtualY, 0, 0,
-			      gbm_bo_get_stride (wlglamor->front_bo), NULL);
+  if (!wlglamor_drawable_use (drawable))
+    {
+      /* cold and could not be restored, better blank than a crash */
+      if (format == ZPixmap)
+	memset (d, 0, PixmapBytePad (w, drawable->depth) * h);
+      else
+	memset (d, 0, BitmapBytePad (w) * h);
+      return;
+    }
 
-  screen->SetScreenPixmap (wlglamor->front_pixmap);
+  if (format == ZPixmap && (plane_mask & mask) == mask &&
+      drawable->depth == pixmap->drawable.depth)
+    {
+      int px = x, py = y;
 
-  handle = gbm_bo_get_handle (wlglamor->front_bo);
-  if (!glamor_egl_create_textured_screen_ext (screen,
-					      handle.u32,
-					      gbm_bo_get_stride 
-						  (wlglamor->front_bo),
-					      NULL))
-    return FALSE;
+      if (drawable->type == DRAWABLE_WINDOW)
+	{
+	  px += drawable->x - pixmap->screen_x;
+	  py += drawable->y - pixmap->screen_y;
+	  if (wlglamor_capture_read (pixmap, px, py, w, h, d))
+	    return;
+	}
+      if (wlglamor_pixmap_read (pixmap, px, py, w, h, d))
+	return;
+    }
 
-  return TRUE;
+  screen->GetImage = wlglamor->GetImage;
+  (*screen->GetImage) (drawable, x, y, w, h, format, plane_mask, d);
+  wlglamor->GetImage = screen->GetImage;
+  screen->GetImage = wlglamor_get_image;
 }
 
-struct dri2_buffer_priv
+/* Moving a window copies its contents within its pixmap, without a GC */
+static void
+wlglamor_copy_window (WindowPtr window, DDXPointRec origin,
+		      RegionPtr src_region)
 {
-  PixmapPtr pixmap;
-  unsigned int attachment;
-  unsigned int refcnt;
-};
+  ScreenPtr screen = window->drawable.pScreen;
+  struct wlglamor_device *wlglamor = wlglamor_screen_priv (screen);
 
+  screen->CopyWindow = wlglamor->CopyWindow;
+  if (wlglamor_drawable_write (&window->drawable))
+    (*screen->CopyWindow) (window, origin, src_region);
+  wlglamor->CopyWindow = screen->CopyWindow;
+  screen->CopyWindow = wlglamor_copy_window;
+}
 
-static PixmapPtr
-get_drawable_pixmap (DrawablePtr drawable)
+/* Render operations write into their destination without going through a
+ * GC, so they need their own hooks. */
+#define WLGLAMOR_PS_UNWRAP(screen, field) \
+  PictureScreenPtr ps = GetPictureScreen (screen); \
+  struct wlglamor_device *wlglamor = wlglamor_screen_priv (screen); \
+  ps->field = wlglamor->field
+
+#define WLGLAMOR_PS_WRAP(field, func) \
+  wlglamor->field = ps->field; \
+  ps->field = func
+
+static void
+wlglamor_composite (CARD8 op, PicturePtr src, PicturePtr mask,
+		    PicturePtr dst, INT16 x_src, INT16 y_src,
+		    INT16 x_mask, INT16 y_mask, INT16 x_dst, INT16 y_dst,
+		    CARD16 width, CARD16 height)
 {
-  if (drawable->type == DRAWABLE_PIXMAP)
-    return (PixmapPtr) drawable;
-  else
-    return (*drawable->pScreen->GetWindowPixmap) ((WindowPtr) drawable);
+  WLGLAMOR_PS_UNWRAP (dst->pDrawable->pScreen, Composite);
+  if (wlglamor_picture_use (src) && wlglamor_picture_use (mask) &&
+      wlglamor_picture_write (dst))
+    (*ps->Composite) (op, src, mask, dst, x_src, y_src, x_mask, y_mask,
+		      x_dst, y_dst, width, height);
+  WLGLAMOR_PS_WRAP (Composite, wlglamor_composite);
 }
 
+static void
+wlglamor_glyphs (CARD8 op, PicturePtr src, PicturePtr dst,
+		 PictFormatPtr mask_format, INT16 x_src, INT16 y_src,
+		 int nlist, GlyphListPtr list, GlyphPtr * glyphs)
+{
+  WLGLAMOR_PS_UNWRAP (dst->pDrawable->pScreen, Glyphs);
+  if (wlglamor_picture_use (src) && wlglamor_picture_write (dst))
+    (*ps->Glyphs) (op, src, dst, mask_format, x_src, y_src, nlist, list,
+		   glyphs);
+  WLGLAMOR_PS_WRAP (Glyphs, wlglamor_glyphs);
+}
 
-static PixmapPtr
-fixup_glamor (DrawablePtr drawable, PixmapPtr pixmap)
+static void
+wlglamor_composite_rects (CARD8 op, PicturePtr dst, xRenderColor * color,
+			  int nrect, xRectangle * rects)
 {
-  PixmapPtr old = get_drawable_pixmap (drawable);
-  ScreenPtr screen = drawable->pScreen;
-  ScrnInfoPtr scrn = xf86ScreenToScrn (screen);
-  struct wlglamor_pixmap *priv =
-    dixLookupPrivate (&pixmap->devPrivates, wlglamor_pixmap_private_key);
-  GCPtr gc;
+  WLGLAMOR_PS_UNWRAP (dst->pDrawable->pScreen, CompositeRects);
+  if (wlglamor_picture_write (dst))
+    (*ps->CompositeRects) (op, dst, color, nrect, rects);
+  WLGLAMOR_PS_WRAP (CompositeRects, wlglamor_composite_rects);
+}
 
-  /* With a glamor pixmap, 2D pixmaps are created in texture
-   * and without a static BO attached to it. To support DRI,
-   * we need to create a new textured-drm pixmap and
-   * need to copy the original content to this new textured-drm
-   * pixmap, and then convert the old pixmap to a coherent
-   * textured-drm pixmap which has a valid BO attached to it
-   * and also has a valid texture, thus both glamor and DRI2
-   * can access it.
-   *
-   */
+static void
+wlglamor_trapezoids (CARD8 op, PicturePtr src, PicturePtr dst,
+		     PictFormatPtr mask_format, INT16 x_src, INT16 y_src,
+		     int ntrap, xTrapezoid * traps)
+{
+  WLGLAMOR_PS_UNWRAP (dst->pDrawable->pScreen, Trapezoids);
+  if (wlglamor_picture_use (src) && wlglamor_picture_write (dst))
+    (*ps->Trapezoids) (op, src, dst, mask_format, x_src, y_src, ntrap,
+		       traps);
+  WLGLAMOR_PS_WRAP (Trapezoids, wlglamor_trapezoids);
+}
 
-  /* Copy the current contents of the pixmap to the bo. */
-  gc = GetScratchGC (drawable->depth, screen);
+static void
+wlglamor_triangles (CARD8 op, PicturePtr src, PicturePtr dst,
+		    PictFormatPtr mask_format, INT16 x_src, INT16 y_src,
+		    int ntri, xTriangle * tris)
+{
+  WLGLAMOR_PS_UNWRAP (dst->pDrawable->pScreen, Triangles);
+  if (wlglamor_picture_use (src) && wlglamor_picture_write (dst))
+    (*ps->Triangles) (op, src, dst, mask_format, x_src, y_src, ntri, tris);
+  WLGLAMOR_PS_WRAP (Triangles, wlglamor_triangles);
+}
 
-  if (gc)
-    {
-      ValidateGC (&pixmap->drawable, gc);
+static void
+wlglamor_add_traps (PicturePtr picture, INT16 x_off, INT16 y_off,
+		    int ntrap, xTrap * traps)
+{
+  WLGLAMOR_PS_UNWRAP (picture->pDrawable->pScreen, AddTraps);
+  if (wlglamor_picture_write (picture))
+    (*ps->AddTraps) (picture, x_off, y_off, ntrap, traps);
+  WLGLAMOR_PS_WRAP (AddTraps, wlglamor_add_traps);
+}
 
-      gc->ops->CopyArea (&old->drawable, &pixmap->drawable,
-			 gc,
-			 0, 0,
-			 old->drawable.width, old->drawable.height, 0, 0);
-      FreeScratchGC (gc);
-    }
+static void
+wlglamor_add_triangles (PicturePtr picture, INT16 x_off, INT16 y_off,
+			int ntri, xTriangle * tris)
+{
+  WLGLAMOR_PS_UNWRAP (picture->pDrawable->pScreen, AddTriangles);
+  if (wlglamor_picture_write (picture))
+    (*ps->AddTriangles) (picture, x_off, y_off, ntri, tris);
+  WLGLAMOR_PS_WRAP (AddTriangles, wlglamor_add_triangles);
+}
 
-  dixSetPrivate (&pixmap->devPrivates, wlglamor_pixmap_private_key, NULL);
+static void
+wlglamor_picture_init (ScreenPtr screen)
+{
+  PictureScreenPtr ps = GetPictureScreenIfSet (screen);
+  struct wlglamor_device *wlglamor = wlglamor_screen_priv (screen);
 
-  /* And redirect the pixmap to the new bo (for 3D). */
-  glamor_egl_exchange_buffers(old, pixmap);
-  dixSetPrivate (&old->devPrivates, wlglamor_pixmap_private_key, priv);
-  old->refcnt++;
-  screen->DestroyPixmap (pixmap);
+  if (!ps)
+    return;
 
-  screen->ModifyPixmapHeader (old,
-			      old->drawable.width,
-			      old->drawable.height,
-			      0, 0, gbm_bo_get_stride (priv->bo), NULL);
-  return old;
+  WLGLAMOR_PS_WRAP (Composite, wlglamor_composite);
+  WLGLAMOR_PS_WRAP (Glyphs, wlglamor_glyphs);
+  WLGLAMOR_PS_WRAP (CompositeRects, wlglamor_composite_rects);
+  WLGLAMOR_PS_WRAP (Trapezoids, wlglamor_trapezoids);
+  WLGLAMOR_PS_WRAP (Triangles, wlglamor_triangles);
+  WLGLAMOR_PS_WRAP (AddTraps, wlglamor_add_traps);
+  WLGLAMOR_PS_WRAP (AddTriangles, wlglamor_add_triangles);
 }
 
-struct gbm_bo *
-wlglamor_get_pixmap_bo (PixmapPtr pixmap)
+static void
+wlglamor_picture_fini (ScreenPtr screen)
 {
-  struct wlglamor_pixmap *priv;
+  PictureScreenPtr ps = GetPictureScreenIfSet (screen);
+  struct wlglamor_device *wlglamor = wlglamor_screen_priv (screen);
 
-  priv = dixLookupPrivate (&pixmap->devPrivates, wlglamor_pixmap_private_key);
-  if (!priv)
-    return NULL;
+  if (!ps)
+    return;
 
-  return priv->bo;
+  ps->Composite = wlglamor->Composite;
+  ps->Glyphs = wlglamor->Glyphs;
+  ps->CompositeRects = wlglamor->CompositeRects;
+  ps->Trapezoids = wlglamor->Trapezoids;
+  ps->Triangles = wlglamor->Triangles;
+  ps->AddTraps = wlglamor->AddTraps;
+  ps->AddTriangles = wlglamor->AddTriangles;
 }
 
 static BufferPtr
@@ -415,6 +2424,21 @@ wlglamor_dri2_create_buffer2 (ScreenPtr pScreen,
       cpp = drawable->bitsPerPixel / 8;
     }
 
+  /* X copies from and to color buffers, which takes a texture: only
+   * depth, stencil and the like may be of other depths */
+  switch (attachment)
+    {
+    case DRI2BufferFrontLeft:
+    case DRI2BufferBackLeft:
+    case DRI2BufferFrontRight:
+    case DRI2BufferBackRight:
+    case DRI2BufferFakeFrontLeft:
+    case DRI2BufferFakeFrontRight:
+      if (!wlglamor_depth_is_textured (depth))
+	return NULL;
+      break;
+    }
+
   pixmap = pScreen->GetScreenPixmap (pScreen);
   front_width = pixmap->drawable.width;
 
@@ -425,6 +2449,8 @@ wlglamor_dri2_create_buffer2 (ScreenPtr pScreen,
       pixmap = get_drawable_pixmap (drawable);
       if (pScreen != pixmap->drawable.pScreen)
 	pixmap = NULL;
+      else if (!wlglamor_pixmap_export (pixmap))
+	return NULL;
       else if (!wlglamor_get_pixmap_bo (pixmap))
 	{
 	  is_glamor_pixmap_with_no_bo = TRUE;
@@ -439,6 +2465,7 @@ wlglamor_dri2_create_buffer2 (ScreenPtr pScreen,
   if (!pixmap && (is_glamor_pixmap_with_no_bo
 		  || attachment != DRI2BufferFrontLeft))
     {
+      flags |= WLGLAMOR_CREATE_PIXMAP_EXPORT;
 
       if (aligned_width == front_width)
 	aligned_width = pScrn->virtualX;
@@ -447,6 +2474,8 @@ wlglamor_dri2_create_buffer2 (ScreenPtr pScreen,
 					 height,
 					 depth,
 					 flags);
+      if (!pixmap)
+	return NULL;		/* over the client's hard limit */
     }
 
   buffers = calloc (1, sizeof *buffers);
@@ -456,13 +2485,20 @@ wlglamor_dri2_create_buffer2 (ScreenPtr pScreen,
   if (pixmap)
     {
       if (is_glamor_pixmap_with_no_bo)	/* attach the new pimap with a bo */
-	pixmap = fixup_glamor (drawable, pixmap);
+	{
+	  PixmapPtr fixed = fixup_glamor (drawable, pixmap);
+
+	  if (!fixed)
+	    goto error;
+	  pixmap = fixed;
+	}
 
       priv = dixLookupPrivate (&pixmap->devPrivates,
 			       wlglamor_pixmap_private_key);
       assert (priv != NULL);
       assert (priv->bo != NULL);
       assert (priv->refcount >= 1);
+      wlglamor_pixmap_export (pixmap);
 
       if (!wlglamor_get_name_from_bo (wlglamor->fd, priv->bo, &buffers->name))
 	{
@@ -574,6 +2610,29 @@ wlglamor_dri2_copy_region2 (ScreenPtr pScreen,
   int off_x = 0, off_y = 0;
   PixmapPtr dst_ppix;
 
+  /* A swap copies the whole back buffer, which then holds the frame now
+   * on screen. Anything else leaves it different from the front. */
+  if (dst_private->attachment == DRI2BufferFrontLeft &&
+      src_private->attachment == DRI2BufferBackLeft &&
+      drawable->type == DRAWABLE_WINDOW)
+    {
+      unsigned int *frame = wlglamor_window_frame ((WindowPtr) drawable);
+      BoxPtr extents = RegionExtents (region);
+
+      if (RegionNumRects (region) == 1 &&
+	  extents->x1 <= 0 && extents->y1 <= 0 &&
+	  extents->x2 >= drawable->width && extents->y2 >= drawable->height)
+	{
+	  /* 0 means "unknown", skip it when the counter wraps */
+	  if (++(*frame) == 0)
+	    ++(*frame);
+	  src_private->frame = *frame;
+	}
+      else
+	src_private->frame = 0;
+      wlglamor_dri2_update_age (drawable, src_buffer);
+    }
+
   dst_ppix = dst_private->pixmap;
   src_drawable = &src_private->pixmap->drawable;
   dst_drawable = &dst_private->pixmap->drawable;
@@ -621,14 +2680,79 @@ wlglamor_dri2_copy_region (DrawablePtr pDraw, RegionPtr pRegion,
 				     pDstBuffer, pSrcBuffer);
 }
 
+/*
+ * A pixmap the GPU could not get a BO for, set up like a demoted one so
+ * that it can be promoted later. It is only queued for that once the
+ * GPU actually uses it, see wlglamor_pixmap_use.
+ */
 static PixmapPtr
-wlglamor_create_pixmap (ScreenPtr screen, int w, int h, int depth,
-			unsigned usage)
+wlglamor_fallback_pixmap (ScreenPtr screen, int w, int h, int depth,
+			  unsigned usage, uint32_t bo_flags)
+{
+  struct wlglamor_device *wlglamor = wlglamor_screen_priv (screen);
+  int stride = PixmapBytePad (w, depth);
+  struct wlglamor_pixmap *priv;
+  PixmapPtr pixmap;
+  void *data;
+
+  if (!wlglamor_depth_is_textured (depth))
+    return NullPixmap;
+
+  pixmap = fbCreatePixmap (screen, 0, 0, depth, usage);
+  if (pixmap == NullPixmap)
+    return NullPixmap;
+
+  priv = calloc (1, sizeof (struct wlglamor_pixmap));
+  data = malloc (stride * h);
+  if (!priv || !data)
+    {
+      free (priv);
+      free (data);
+      fbDestroyPixmap (pixmap);
+      return NullPixmap;
+    }
+
+  priv->bo_flags = bo_flags;
+  priv->refcount = 1;
+  priv->pixmap = pixmap;
+  priv->sysmem = data;
+  priv->fallback = TRUE;
+  priv->client = wlglamor_current_client (wlglamor);
+  priv->client_generation = wlglamor->client_usage[priv->client].generation;
+  priv->last_use = priv->last_write = GetTimeInMillis ();
+  xorg_list_init (&priv->link);
+
+  dixSetPrivate (&pixmap->devPrivates, wlglamor_pixmap_private_key, priv);
+  screen->ModifyPixmapHeader (pixmap, w, h, 0, 0, stride, data);
+  return pixmap;
+}
+
+static PixmapPtr
+wlglamor_new_pixmap (ScreenPtr screen, int w, int h, int depth,
+		     unsigned usage)
 {
   ScrnInfoPtr scrn = xf86ScreenToScrn (screen);
   struct wlglamor_pixmap *priv;
   struct wlglamor_device *wlglamor = wlglamor_screen_priv (screen);
   PixmapPtr pixmap, new_pixmap = NULL;
+  uint32_t bo_flags = GBM_BO_USE_RENDERING;
+  Bool offscreen, export, failed = FALSE;
+  unsigned int window = 0;
+
+  /* Only buffers that may reach the compositor need to be scanout
+   * capable; asking for it on every pixmap forces the most conservative
+   * layout on purely offscreen ones. xwayland only ever attaches window
+   * pixmaps: DRI2 back buffers are copied into them on swap. */
+  if (usage == CREATE_PIXMAP_USAGE_BACKING_PIXMAP)
+    bo_flags |= GBM_BO_USE_SCANOUT;
+  export = (usage & WLGLAMOR_CREATE_PIXMAP_EXPORT) != 0;
+  offscreen = !(bo_flags & GBM_BO_USE_SCANOUT) && !export;
+  if (usage == CREATE_PIXMAP_USAGE_BACKING_PIXMAP)
+    {
+      window = wlglamor->resizing_window;
+      wlglamor->resizing_window = 0;
+    }
+  usage &= ~WLGLAMOR_CREATE_PIXMAP_EXPORT;
 
   if (w > 32767 || h > 32767)
     return NullPixmap;
@@ -636,8 +2760,57 @@ wlglamor_create_pixmap (ScreenPtr screen, int w, int h, int depth,
   if (depth == 1)
     return fbCreatePixmap (screen, w, h, depth, usage);
 
-  if (usage == CREATE_PIXMAP_USAGE_GLYPH_PICTURE && w <= 32 && h <= 32)
-    return fbCreatePixmap (screen, w, h, depth, usage);
+  /* glamor_glyphs_init sets up glamor's own GPU glyph cache, the atlas
+   * glyphs are actually rendered from. A small glyph picture is only
+   * read when its glyph enters that cache, so system memory is the right
+   * place for it. Larger glyphs are composited straight from their
+   * picture every time and never leave the server: give them a texture,
+   * never a BO. */
+  if (usage == CREATE_PIXMAP_USAGE_GLYPH_PICTURE)
+    {
+      if (w <= 32 && h <= 32)
+	return fbCreatePixmap (screen, w, h, depth, usage);
+
+      new_pixmap = glamor_create_pixmap (screen, w, h, depth, usage);
+      if (new_pixmap)
+	return new_pixmap;
+    }
+
+  /* Other depths are rendered by glamor from plain textures. DRI2 still
+   * needs a BO to share, a 16 bit depth buffer for instance, but X never
+   * draws into those: they get a BO without a texture below, and only
+   * they do. */
+  if (!export && !wlglamor_depth_is_textured (depth))
+    {
+      new_pixmap = glamor_create_pixmap (screen, w, h, depth, usage);
+      if (new_pixmap)
+	return new_pixmap;
+      return fbCreatePixmap (screen, w, h, depth, usage);
+    }
+
+  /* A single BO (and its EGLImage) is limited to what the GPU can
+   * texture from. glamor splits larger pixmaps into a grid of textures
+   * and renders them tile by tile, which keeps them on the GPU; only
+   * pixmaps that may be handed out need to be a single BO. */
+  if (offscreen &&
+      (w > wlglamor->max_bo_size || h > wlglamor->max_bo_size))
+    {
+      new_pixmap = glamor_create_pixmap (screen, w, h, depth, usage);
+      if (new_pixmap)
+	return new_pixmap;
+    }
+
+  /* A BO per icon or gradient strip costs a page-granular GEM object
+   * each. Small offscreen pixmaps become plain glamor textures instead,
+   * which glamor recycles through its FBO cache. Should DRI2 ever need
+   * one, fixup_glamor gives it a BO then. */
+  if (offscreen && w && h &&
+      PixmapBytePad (w, depth) * h <= wlglamor->small_pixmap_size)
+    {
+      new_pixmap = glamor_create_pixmap (screen, w, h, depth, usage);
+      if (new_pixmap)
+	return new_pixmap;
+    }
 
   pixmap = fbCreatePixmap (screen, 0, 0, depth, usage);
   if (pixmap == NullPixmap)
@@ -646,55 +2819,119 @@ wlglamor_create_pixmap (ScreenPtr screen, int w, int h, int depth,
   if (w && h)
     {
       union gbm_bo_handle handle;
+      uint64_t size;
+
+      if (offscreen &&
+	  wlglamor_alloc_known_bad (wlglamor, w, h, depth, bo_flags))
+	{
+	  new_pixmap = glamor_create_pixmap (screen, w, h, depth, usage);
+	  failed = TRUE;
+	  goto fallback_pixmap;
+	}
+
       priv = calloc (1, sizeof (struct wlglamor_pixmap));
       if (priv == NULL)
 	goto fallback_pixmap;
 
-      priv->bo = gbm_bo_create (wlglamor->gbm, w, h, GBM_FORMAT_ARGB8888,
-				GBM_BO_USE_RENDERING | GBM_BO_USE_SCANOUT);
+      if (window)
+	priv->bo = wlglamor_resize_bo_get (wlglamor, window, w, h, depth,
+					   bo_flags);
+      else
+	priv->bo = wlglamor_bo_create (wlglamor, w, h, depth, bo_flags);
       if (!priv->bo)
-	goto fallback_priv;
+	goto fallback_bo;
+
+      /* Checked against what the BO is charged. Windows are exempt from
+       * the hard limit, they are not the client's to do without. */
+      size = wlglamor_bo_size (priv->bo);
+      if (usage != CREATE_PIXMAP_USAGE_BACKING_PIXMAP &&
+	  wlglamor_client_over_limit (wlglamor, size, TRUE))
+	{
+	  wlglamor_bo_destroy (wlglamor, priv->bo);
+	  free (priv);
+	  fbDestroyPixmap (pixmap);
+	  return NullPixmap;
+	}
+      if (offscreen && wlglamor_client_over_limit (wlglamor, size, FALSE))
+	{
+	  wlglamor_bo_destroy (wlglamor, priv->bo);
+	  free (priv);
+	  goto fallback_pixmap;
+	}
+      priv->bo_flags = bo_flags;
+      priv->window = window;
+      priv->client = wlglamor_current_client (wlglamor);
+      priv->client_generation =
+	wlglamor->client_usage[priv->client].generation;
 
       handle = gbm_bo_get_handle (priv->bo);
       priv->refcount = 1;
+      priv->pixmap = pixmap;
+      priv->last_use = priv->last_write = GetTimeInMillis ();
+      xorg_list_init (&priv->link);
 
       dixSetPrivate (&pixmap->devPrivates, wlglamor_pixmap_private_key, priv);
 
       screen->ModifyPixmapHeader (pixmap, w, h, 0, 0,
 				  gbm_bo_get_stride (priv->bo), NULL);
 
-      if (!glamor_egl_create_textured_pixmap (pixmap, handle.u32,
-					      gbm_bo_get_stride (priv->bo)))
-	goto fallback_glamor;
+      if (wlglamor_depth_is_textured (depth))
+	{
+	  if (!glamor_egl_create_textured_pixmap (pixmap, handle.u32,
+						  gbm_bo_get_stride (priv->bo)))
+	    goto fallback_glamor;
+	  xorg_list_append (&priv->link, &wlglamor->pixmaps);
+	}
+      wlglamor_pixmap_charge (wlglamor, priv);
     }
 
   return pixmap;
 
 fallback_glamor:
-  new_pixmap = glamor_create_pixmap (screen, w, h, depth, usage);
-  gbm_bo_destroy (priv->bo);
+  wlglamor_bo_destroy (wlglamor, priv->bo);
 
-fallback_priv:
+fallback_bo:
+  if (offscreen)
+    wlglamor_alloc_failed (wlglamor, w, h, depth, bo_flags);
+  /* Still better rendered by the GPU than by fb */
+  new_pixmap = glamor_create_pixmap (screen, w, h, depth, usage);
   free (priv);
+  failed = TRUE;
 
 fallback_pixmap:
   fbDestroyPixmap (pixmap);
 
+  if (!new_pixmap && failed)
+    new_pixmap = wlglamor_fallback_pixmap (screen, w, h, depth, usage,
+					   bo_flags);
   if (new_pixmap)
     return new_pixmap;
   else
     return fbCreatePixmap (screen, w, h, depth, usage);
 }
 
-static Bool
-wlglamor_destroy_pixmap (PixmapPtr pixmap)
+static PixmapPtr
+wlglamor_create_pixmap (ScreenPtr screen, int w, int h, int depth,
+			unsigned usage)
+{
+  PixmapPtr pixmap;
+
+  pixmap = wlglamor_new_pixmap (screen, w, h, depth, usage);
+  if (pixmap && usage == CREATE_PIXMAP_USAGE_BACKING_PIXMAP)
+    wlglamor_dirty_track (wlglamor_screen_priv (screen), pixmap);
+
+  return pixmap;
+}
+
+static void
+wlglamor_free_pixmap (PixmapPtr pixmap)
 {
   if (pixmap->refcnt == 1)
     {
       glamor_egl_destroy_textured_pixmap (pixmap);
       {
 	struct wlglamor_device *wlglamor =
-	  wlglamor_screen_priv ((pixmap->drawable.pScreen));
+	  wlglamor_screen_priv (pixmap->drawable.pScreen);
 	struct wlglamor_pixmap *priv;
 
 	priv =
@@ -703,8 +2940,29 @@ wlglamor_destroy_pixmap (PixmapPtr pixmap)
 	if (priv)
 	  {
 	    priv->refcount--;
-	    if (priv->bo && priv->refcount < 1)
-	      gbm_bo_destroy (priv->bo);	/* dereference only */
+	    if (priv->refcount < 1)
+	      wlglamor_pixmap_uncharge (wlglamor, priv);
+	    if (priv->bo && priv->refcount < 1 &&
+		wlglamor_dedup_leave (wlglamor, priv))
+	      {
+		if (priv->window && !priv->exported &&
+		    xf86ScreenToScrn (pixmap->drawable.pScreen)->vtSema)
+		  wlglamor_resize_bo_put (wlglamor, priv->window, priv->bo,
+					  pixmap->drawable.depth);
+		else
+		  wlglamor_bo_destroy (wlglamor, priv->bo);	/* dereference only */
+	      }
+	    if (priv->userptr)
+	      wlglamor_gem_close (wlglamor->fd, priv->userptr);
+	    xorg_list_del (&priv->link);
+	    free (priv->sysmem);
+	    if (priv->cold)
+	      {
+		wlglamor->cold_bytes -= priv->cold_size;
+		wlglamor->cold_raw_bytes -=
+		  pixmap->devKind * pixmap->drawable.height;
+		free (priv->cold);
+	      }
 	    free (priv);
 	    priv = NULL;
 	  }
@@ -715,6 +2973,42 @@ wlglamor_destroy_pixmap (PixmapPtr pixmap)
       }
     }
   fbDestroyPixmap (pixmap);
+}
+
+void
+wlglamor_drain_deferred_destroy (struct wlglamor_device *wlglamor)
+{
+  int i;
+
+  for (i = 0; i < wlglamor->num_deferred_destroy; i++)
+    wlglamor_free_pixmap (wlglamor->deferred_destroy[i]);
+  wlglamor->num_deferred_destroy = 0;
+}
+
+static Bool
+wlglamor_destroy_pixmap (PixmapPtr pixmap)
+{
+  ScrnInfoPtr pScrn = xf86ScreenToScrn (pixmap->drawable.pScreen);
+  struct wlglamor_device *wlglamor = wlglamor_scrninfo_priv (pScrn);
+
+  /* Destroying a BO backed pixmap means an EGLImage teardown and a GEM
+   * close which may wait for the GPU. Nobody else holds the last
+   * reference, so queue it and let the block handler do the work.
+   * Once the screen is closing, there is no block handler left to run. */
+  if (!wlglamor->closing && pScrn->vtSema && pixmap->refcnt == 1 &&
+      wlglamor_get_pixmap_bo (pixmap))
+    {
+      struct wlglamor_pixmap *priv =
+	dixLookupPrivate (&pixmap->devPrivates, wlglamor_pixmap_private_key);
+
+      xorg_list_del (&priv->link);	/* no point demoting it now */
+      if (wlglamor->num_deferred_destroy == WLGLAMOR_DEFERRED_DESTROY_MAX)
+	wlglamor_drain_deferred_destroy (wlglamor);
+      wlglamor->deferred_destroy[wlglamor->num_deferred_destroy++] = pixmap;
+      return TRUE;
+    }
+
+  wlglamor_free_pixmap (pixmap);
   return TRUE;
 }
 
@@ -729,6 +3023,14 @@ wlglamor_screen_init (SCREEN_INIT_ARGS_DECL)
   if (!dixRegisterPrivateKey (wlglamor_pixmap_private_key, PRIVATE_PIXMAP, 0))
     return BadAlloc;
 
+  if (!dixRegisterPrivateKey (wlglamor_window_private_key, PRIVATE_WINDOW,
+			      sizeof (struct wlglamor_window)))
+    return BadAlloc;
+
+  if (!dixRegisterPrivateKey (wlglamor_gc_private_key, PRIVATE_GC,
+			      sizeof (struct wlglamor_gc)))
+    return BadAlloc;
+
   pScrn = xf86Screens[pScreen->myNum];
   wlglamor = wlglamor_screen_priv (pScreen);
 
@@ -777,10 +3079,15 @@ wlglamor_screen_init (SCREEN_INIT_ARGS_DECL)
 
   /* End of DRI2 Initialization */
 
-  wlglamor->front_bo = gbm_bo_create (wlglamor->gbm, pScrn->virtualX,
-				      pScrn->virtualY, GBM_FORMAT_ARGB8888,
-				      GBM_BO_USE_RENDERING |
-				      GBM_BO_USE_SCANOUT);
+  wlglamor->closing = FALSE;
+  wlglamor_pressure_init (pScrn, wlglamor);
+
+  wlglamor->lazy_front = xorgRootless && wlglamor->release_idle_front &&
+    wlglamor->idle_timeout;
+  wlglamor->front_bo = wlglamor_bo_create (wlglamor, pScrn->virtualX,
+					   pScrn->virtualY, pScrn->depth,
+					   GBM_BO_USE_RENDERING |
+					   GBM_BO_USE_SCANOUT);
   if (!wlglamor->front_bo)
     return FALSE;
 
@@ -833,9 +3140,29 @@ wlglamor_screen_init (SCREEN_INIT_ARGS_DECL)
 		  "Failed to initialize textured pixmap of screen for glamor.\n");
       return FALSE;
     }
+  xorg_list_init (&wlglamor->dirty_pixmaps);
+  xorg_list_init (&wlglamor->damaged_windows);
+  xorg_list_init (&wlglamor->shm_pixmaps);
+  /* Atoms and the root window are gone after a server reset */
+  wlglamor->statistics_atom = 0;
+  free (wlglamor->statistics);
+  wlglamor->statistics = NULL;
   pScreen->CreatePixmap = wlglamor_create_pixmap;
   pScreen->DestroyPixmap = wlglamor_destroy_pixmap;
 
+  wlglamor->CreateGC = pScreen->CreateGC;
+  pScreen->CreateGC = wlglamor_create_gc;
+  wlglamor->SourceValidate = pScreen->SourceValidate;
+  pScreen->SourceValidate = wlglamor_source_validate;
+  wlglamor->GetImage = pScreen->GetImage;
+  pScreen->GetImage = wlglamor_get_image;
+  wlglamor->CopyWindow = pScreen->CopyWindow;
+  pScreen->CopyWindow = wlglamor_copy_window;
+  wlglamor->ConfigNotify = pScreen->ConfigNotify;
+  pScreen->ConfigNotify = wlglamor_config_notify;
+  wlglamor_picture_init (pScreen);
+  wlglamor_shm_init (pScreen);
+
   xf86SetSilkenMouse (pScreen);
 
   /* Initialise cursor functions */
@@ -862,6 +3189,21 @@ wlglamor_screen_init (SCREEN_INIT_ARGS_DECL)
   if (!AddCallback (&FlushCallback, wlglamor_flush_callback, pScrn))
     return FALSE;
 
+  if (!wlglamor_client_accounting_init (wlglamor))
+    return FALSE;
+
+  {
+    xf86CrtcConfigPtr config = XF86_CRTC_CONFIG_PTR (pScrn);
+
+    /* Already ours from the previous server generation */
+    if (config->funcs != &wlglamor->crtc_config_funcs)
+      {
+	wlglamor->crtc_config_funcs = *config->funcs;
+	wlglamor->crtc_config_funcs.resize = wlglamor_xf86crtc_resize;
+	config->funcs = &wlglamor->crtc_config_funcs;
+      }
+  }
+
   if (!xf86CrtcScreenInit (pScreen))
     return FALSE;
 
@@ -887,7 +3229,7 @@ wlglamor_create_window_buffer (struct xwl_window *xwl_window,
   struct gbm_bo *bo = wlglamor_get_pixmap_bo (pixmap);
   struct wlglamor_device *wlglamor = wlglamor_scrninfo_priv (pScrn);
 
-  if (!bo)
+  if (!bo || !wlglamor_pixmap_export (pixmap))
     return 0;
   if (!wlglamor_get_name_from_bo (wlglamor->fd, bo, &name))
     {
@@ -904,7 +3246,42 @@ static struct xwl_driver xwl_driver = {
   .create_window_buffer = wlglamor_create_window_buffer
 };
 
+typedef enum
+{
+  OPTION_MEMORY_BUDGET,
+  OPTION_IDLE_PIXMAP_TIMEOUT,
+  OPTION_PRESSURE_THRESHOLD,
+  OPTION_COLD_PIXMAP_TIMEOUT,
+  OPTION_PIXMAP_DEDUP,
+  OPTION_SMALL_PIXMAP_SIZE,
+  OPTION_MAX_BO_SIZE,
+  OPTION_CLIENT_SOFT_LIMIT,
+  OPTION_CLIENT_HARD_LIMIT,
+  OPTION_RELEASE_IDLE_FRONT,
+  OPTION_DAMAGE_COMPACT_THRESHOLD,
+  OPTION_DAMAGE_COMPACT_RECTS,
+  OPTION_DAMAGE_REQUEST_COST,
+  OPTION_SHM_PIXMAP_SIZE,
+} wlglamor_opts;
+
 static const OptionInfoRec wlglamor_options[] = {
+  {OPTION_MEMORY_BUDGET, "MemoryBudget", OPTV_INTEGER, {0}, FALSE},
+  {OPTION_IDLE_PIXMAP_TIMEOUT, "IdlePixmapTimeout", OPTV_INTEGER, {0}, FALSE},
+  {OPTION_PRESSURE_THRESHOLD, "PressureThreshold", OPTV_INTEGER, {0}, FALSE},
+  {OPTION_COLD_PIXMAP_TIMEOUT, "ColdPixmapTimeout", OPTV_INTEGER, {0}, FALSE},
+  {OPTION_PIXMAP_DEDUP, "PixmapDedup", OPTV_BOOLEAN, {0}, FALSE},
+  {OPTION_SMALL_PIXMAP_SIZE, "SmallPixmapSize", OPTV_INTEGER, {0}, FALSE},
+  {OPTION_MAX_BO_SIZE, "MaxBOSize", OPTV_INTEGER, {0}, FALSE},
+  {OPTION_CLIENT_SOFT_LIMIT, "ClientSoftLimit", OPTV_INTEGER, {0}, FALSE},
+  {OPTION_CLIENT_HARD_LIMIT, "ClientHardLimit", OPTV_INTEGER, {0}, FALSE},
+  {OPTION_RELEASE_IDLE_FRONT, "ReleaseIdleFront", OPTV_BOOLEAN, {0}, FALSE},
+  {OPTION_DAMAGE_COMPACT_THRESHOLD, "DamageCompactThreshold", OPTV_INTEGER,
+   {0}, FALSE},
+  {OPTION_DAMAGE_COMPACT_RECTS, "DamageCompactRects", OPTV_INTEGER, {0},
+   FALSE},
+  {OPTION_DAMAGE_REQUEST_COST, "DamageRequestCost", OPTV_INTEGER, {0},
+   FALSE},
+  {OPTION_SHM_PIXMAP_SIZE, "ShmPixmapSize", OPTV_INTEGER, {0}, FALSE},
   {-1, NULL, OPTV_NONE, {0}, FALSE}
 };
 
@@ -934,6 +3311,7 @@ wlglamor_pre_init (ScrnInfoPtr pScrn, int flags)
     return FALSE;
 
   wlglamor = wlglamor_scrninfo_priv (pScrn);
+  wlglamor->scrn_index = pScrn->scrnIndex;
 
   pScrn->chipset = WAYLAND_DRIVER_NAME;
   pScrn->monitor = pScrn->confScreen->monitor;
@@ -949,6 +3327,15 @@ wlglamor_pre_init (ScrnInfoPtr pScrn, int flags)
     case 24:
       break;
 
+    case 16:
+      /* glamor_egl can only make textures of 24 and 32 bit deep BOs,
+       * and wl_drm buffers are sent to the compositor as XRGB8888
+       * whatever their depth: neither can be fixed from here. */
+      xf86DrvMsg (pScrn->scrnIndex, X_ERROR,
+		  "Depth 16 needs 16 bit EGLImage support in glamor and "
+		  "RGB565 wl_drm buffers in xwayland\n");
+      goto error;
+
     default:
       xf86DrvMsg (pScrn->scrnIndex, X_ERROR,
 		  "Given depth (%d) is not supported by %s driver\n",
@@ -998,6 +3385,67 @@ wlglamor_pre_init (ScrnInfoPtr pScrn, int flags)
 
   xf86ProcessOptions (pScrn->scrnIndex, pScrn->options, wlglamor->options);
 
+  {
+    int budget = 0, timeout = 60, cold_timeout = 0;
+    int soft_limit = 0, hard_limit = 0;
+    int compact_threshold = 64, compact_rects = 16, request_cost = 4096;
+
+    wlglamor->pressure_threshold = 10;
+    xf86GetOptValInteger (wlglamor->options, OPTION_MEMORY_BUDGET, &budget);
+    xf86GetOptValInteger (wlglamor->options, OPTION_IDLE_PIXMAP_TIMEOUT,
+			  &timeout);
+    xf86GetOptValInteger (wlglamor->options, OPTION_PRESSURE_THRESHOLD,
+			  &wlglamor->pressure_threshold);
+    wlglamor->memory_budget = (uint64_t) max (budget, 0) << 20;
+    wlglamor->idle_timeout = max (timeout, 0) * 1000;
+
+    xf86GetOptValInteger (wlglamor->options, OPTION_COLD_PIXMAP_TIMEOUT,
+			  &cold_timeout);
+#ifdef HAVE_LZ4
+    wlglamor->cold_timeout = max (cold_timeout, 0) * 1000;
+#else
+    if (cold_timeout > 0)
+      xf86DrvMsg (pScrn->scrnIndex, X_WARNING,
+		  "ColdPixmapTimeout ignored, built without LZ4 support\n");
+#endif
+
+    wlglamor->dedup = xf86ReturnOptValBool (wlglamor->options,
+					    OPTION_PIXMAP_DEDUP, FALSE);
+    wlglamor->release_idle_front =
+      xf86ReturnOptValBool (wlglamor->options, OPTION_RELEASE_IDLE_FRONT,
+			    FALSE);
+
+    wlglamor->small_pixmap_size = 16384;
+    xf86GetOptValInteger (wlglamor->options, OPTION_SMALL_PIXMAP_SIZE,
+			  &wlglamor->small_pixmap_size);
+
+    wlglamor->max_bo_size = 8192;
+    xf86GetOptValInteger (wlglamor->options, OPTION_MAX_BO_SIZE,
+			  &wlglamor->max_bo_size);
+
+    xf86GetOptValInteger (wlglamor->options, OPTION_CLIENT_SOFT_LIMIT,
+			  &soft_limit);
+    xf86GetOptValInteger (wlglamor->options, OPTION_CLIENT_HARD_LIMIT,
+			  &hard_limit);
+    wlglamor->client_soft_limit = (uint64_t) max (soft_limit, 0) << 20;
+    wlglamor->client_hard_limit = (uint64_t) max (hard_limit, 0) << 20;
+
+    xf86GetOptValInteger (wlglamor->options, OPTION_DAMAGE_COMPACT_THRESHOLD,
+			  &compact_threshold);
+    xf86GetOptValInteger (wlglamor->options, OPTION_DAMAGE_COMPACT_RECTS,
+			  &compact_rects);
+    xf86GetOptValInteger (wlglamor->options, OPTION_DAMAGE_REQUEST_COST,
+			  &request_cost);
+    wlglamor->damage_compact_threshold = max (compact_threshold, 0);
+    wlglamor->damage_compact_rects = max (compact_rects, 1);
+    wlglamor->damage_request_cost = max (request_cost, 0);
+
+    wlglamor->shm_pixmap_size = 0;
+    xf86GetOptValInteger (wlglamor->options, OPTION_SHM_PIXMAP_SIZE,
+			  &wlglamor->shm_pixmap_size);
+    wlglamor->shm_pixmap_size = max (wlglamor->shm_pixmap_size, 0);
+  }
+
   wlglamor->xwl_screen = xwl_screen_create ();
   if (!wlglamor->xwl_screen)
     {
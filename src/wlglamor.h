@@ -6,11 +6,15 @@
 #include "xf86_OSproc.h"
 
 #include "xf86Cursor.h"
+#include "xf86Crtc.h"
+#include "picturestr.h"
+#include "damage.h"
 #include <dri2.h>
 #include <gbm.h>
 #include <string.h>
 
 #include "xwayland.h"
+#include "list.h"
 
 #include "compat-api.h"
 
@@ -19,6 +23,42 @@
     ((PACKAGE_VERSION_MAJOR << 16) | (PACKAGE_VERSION_MINOR << 8) | \
      PACKAGE_VERSION_PATCHLEVEL)
 
+/* Driver private CreatePixmap usage flag: the pixmap is created for a DRI2
+ * buffer and needs a BO of its own. */
+#define WLGLAMOR_CREATE_PIXMAP_EXPORT 0x20000000
+
+/* Interactive resize: BOs are rounded up to this many pixels, and a
+ * window resized again within WLGLAMOR_RESIZE_SETTLE ms is resizing. */
+#define WLGLAMOR_RESIZE_STEP 64
+#define WLGLAMOR_RESIZE_SETTLE 500
+#define WLGLAMOR_RESIZE_POOL_MAX 4
+
+/* Window capture staging BO: size granularity in pixels, and how long
+ * it is kept without captures (ms) */
+#define WLGLAMOR_CAPTURE_STEP 256
+#define WLGLAMOR_CAPTURE_TIMEOUT 2000
+
+/* Recent BO allocation failures remembered, and for how long (ms) */
+#define WLGLAMOR_ALLOC_FAILURES_MAX 16
+#define WLGLAMOR_ALLOC_FAILURE_TIMEOUT 10000
+
+/* Freed BO-backed pixmaps waiting for the block handler to tear them down */
+#define WLGLAMOR_DEFERRED_DESTROY_MAX 64
+
+/* How often the memory pressure sources are polled, in ms */
+#define WLGLAMOR_PRESSURE_CHECK_INTERVAL 1000
+/* Upper bound of pixmaps demoted per block handler run */
+#define WLGLAMOR_DEMOTE_PER_CYCLE 16
+/* Upper bound of fallback pixmaps given a BO per block handler run */
+#define WLGLAMOR_PROMOTE_PER_CYCLE 8
+#define WLGLAMOR_DEDUP_BUCKETS 64
+#define WLGLAMOR_DEDUP_DELAY 2000	/* ms without writes before hashing */
+#define WLGLAMOR_DEDUP_MAX_SIZE (256 * 1024)
+#define WLGLAMOR_DEDUP_PER_CYCLE 16
+
+/* How often the root window statistics property may change, in ms */
+#define WLGLAMOR_STATISTICS_INTERVAL 1000
+
 /* globals */
 struct wlglamor_device
 {
@@ -32,19 +72,180 @@ struct wlglamor_device
     UnrealizeWindowProcPtr UnrealizeWindow;
     SetWindowPixmapProcPtr SetWindowPixmap;
     CreateScreenResourcesProcPtr CreateScreenResources;
+    CreateGCProcPtr CreateGC;
+    SourceValidateProcPtr SourceValidate;
+    ConfigNotifyProcPtr ConfigNotify;
+    GetImageProcPtr GetImage;
+    CopyWindowProcPtr CopyWindow;
+    CompositeProcPtr Composite;
+    GlyphsProcPtr Glyphs;
+    CompositeRectsProcPtr CompositeRects;
+    TrapezoidsProcPtr Trapezoids;
+    TrianglesProcPtr Triangles;
+    AddTrapsProcPtr AddTraps;
+    AddTrianglesProcPtr AddTriangles;
     
     void (*BlockHandler)(BLOCKHANDLER_ARGS_DECL);
 
     int fd;
     struct gbm_device *gbm;
-    struct gbm_bo* front_bo;
+    struct gbm_bo* front_bo;		/* NULL while released */
+    struct gbm_bo *front_placeholder;	/* textures the front meanwhile */
     PixmapPtr front_pixmap;
+    Bool release_idle_front;		/* ReleaseIdleFront */
+    Bool lazy_front;			/* rootless: release the idle front */
+    CARD32 front_last_use;
+    Bool front_exposed;			/* reallocated, root needs repaint */
+    xf86CrtcConfigFuncsRec crtc_config_funcs;	/* with our resize */
     struct xwl_screen *xwl_screen;
+
+    Bool unflushed;			/* X rendering glamor may still hold */
+
+    /* pixmaps reaching the compositor drawn to since the last post */
+    struct xorg_list dirty_pixmaps;
+    Bool dirty_untracked;		/* some can't be watched, always post */
+
+    /* xwayland's window damage, compacted before it is posted */
+    struct xorg_list damaged_windows;	/* reported since the last post */
+    RealizeWindowProcPtr RealizeWindow;
+    WindowPtr realizing_window;		/* xwayland registers its damage */
+    CloseScreenProcPtr DamageCloseScreen;
+    DamageScreenRegisterFunc DamageRegister;
+    DamageScreenUnregisterFunc DamageUnregister;
+    DamageScreenDestroyFunc DamageDestroy;
+    int damage_compact_threshold;	/* boxes, 0 disables */
+    int damage_compact_rects;
+    int damage_request_cost;		/* in pixels */
+
+    PixmapPtr deferred_destroy[WLGLAMOR_DEFERRED_DESTROY_MAX];
+    int num_deferred_destroy;
+    Bool closing;			/* no block handler to drain it any more */
+
+    /* window pixmap BOs kept around while their window is being resized */
+    struct wlglamor_resize_bo {
+	struct gbm_bo *bo;
+	unsigned int window;	/* see struct wlglamor_window */
+	int depth;
+	CARD32 time;
+    } resize_pool[WLGLAMOR_RESIZE_POOL_MAX];
+    int num_resize_pool;
+    unsigned int resizing_window;	/* composite reallocates it next, or 0 */
+    unsigned int window_id;	/* last one handed out */
+
+    /* linear staging buffer for window GetImage */
+    struct gbm_bo *capture_bo;
+    PixmapPtr capture_pixmap;
+    CARD32 capture_last_use;
+
+    /* MIT-SHM pixmaps on userptr objects */
+    struct xorg_list shm_pixmaps;	/* rendered to by the GPU */
+    int shm_pixmap_size;		/* bytes, 0 disables */
+    Bool shm_userptr;			/* cleared if the kernel lacks it */
+
+    /* negative cache of BO allocations that failed */
+    struct wlglamor_alloc_failure {
+	int width, height, depth;
+	uint32_t flags;
+	CARD32 time;
+    } alloc_failures[WLGLAMOR_ALLOC_FAILURES_MAX];
+    int alloc_failure_next;
+    unsigned long num_alloc_failures;
+    unsigned long num_alloc_failure_hits;
+
+    /* per client BO accounting, by client index */
+    int scrn_index;			/* for messages from callbacks */
+    ClientPtr current_client;		/* whose request is being processed */
+    struct wlglamor_client_usage {
+	uint64_t bytes;
+	uint64_t peak;
+	unsigned int generation;	/* bumped when the client goes away */
+	Bool over_soft_limit;
+    } client_usage[MAXCLIENTS];
+    uint64_t client_soft_limit;		/* 0 for none */
+    uint64_t client_hard_limit;
+
+    /* memory pressure */
+    struct xorg_list pixmaps;		/* BO backed, least recently used first */
+    struct xorg_list demoted_pixmaps;	/* in system memory, same order */
+    struct xorg_list cold_pixmaps;	/* compressed */
+    struct xorg_list fallback_pixmaps;	/* used by the GPU, awaiting a BO */
+    uint64_t bo_bytes;
+    uint64_t memory_budget;		/* 0 for no budget */
+    int small_pixmap_size;		/* bytes, glamor textures up to this */
+    int max_bo_size;			/* pixels, larger ones are tiled */
+    CARD32 idle_timeout;
+    int pressure_threshold;		/* PSI some avg10, in percent */
+    int psi_fd;
+    int cgroup_events_fd;
+    unsigned long cgroup_events;
+    OsTimerPtr pressure_timer;
+    Bool under_pressure;
+    Bool trim_pending;
+
+    /* cold pixmap store */
+    CARD32 cold_timeout;		/* 0 when disabled */
+    uint64_t cold_bytes;		/* compressed size */
+    uint64_t cold_raw_bytes;		/* size once restored */
+
+    /* root window WLGLAMOR_STATISTICS property */
+    Atom statistics_atom;		/* 0 until first published */
+    char *statistics;			/* as last published */
+    CARD32 statistics_time;
+
+    /* pixmap deduplication */
+    Bool dedup;
+    struct xorg_list dedup_table[WLGLAMOR_DEDUP_BUCKETS];
+    uint64_t dedup_saved;
+    uint64_t dedup_saved_peak;
+};
+
+/* One BO holding contents shared by identical pixmaps */
+struct wlglamor_dedup {
+    struct xorg_list link;	/* in the hash bucket */
+    struct xorg_list members;
+    int count;
+    uint64_t hash;
+    struct gbm_bo *bo;
 };
 
 struct wlglamor_pixmap {
     struct gbm_bo *bo;
+    uint32_t bo_flags;	/* gbm usage the pixmap was created for */
     int refcount;
+
+    PixmapPtr pixmap;
+    struct xorg_list link;
+    CARD32 last_use;
+    Bool exported;	/* shared with a DRI2 client or the compositor */
+    void *sysmem;	/* contents while demoted */
+    void *cold;		/* compressed contents, sysmem is NULL then */
+    Bool fallback;	/* no BO could be allocated yet, in sysmem */
+    uint32_t userptr;	/* GEM handle over a client shm segment, or 0 */
+    int cold_size;
+    CARD32 last_write;
+    struct wlglamor_dedup *shared;	/* NULL until hashed */
+    Bool hashed;	/* not written to since, no need to hash again */
+    struct xorg_list shared_link;
+    unsigned int window;	/* backing pixmap allocated with resize headroom */
+    int client;		/* index of the client charged, 0 for the server */
+    unsigned int client_generation;
+    uint64_t charged;
+};
+
+/* Damage watch on a pixmap xwayland posts to the compositor */
+struct wlglamor_dirty {
+    struct xorg_list link;	/* in dirty_pixmaps while it has damage */
+    struct wlglamor_device *wlglamor;
+    DamagePtr damage;
+};
+
+struct wlglamor_window {
+    unsigned int frame;		/* full swaps done, see DRI2 buffer age */
+    CARD32 last_resize;
+    unsigned int id;		/* set once resized interactively, never reused */
+    DamagePtr damage;		/* xwayland's, see wlglamor_damage_register */
+    DamageReportFunc damage_report;	/* its own callback */
+    struct xorg_list damage_link;	/* in damaged_windows */
 };
 
 static inline struct wlglamor_device *wlglamor_scrninfo_priv(ScrnInfoPtr pScrn)
@@ -57,4 +258,66 @@ static inline struct wlglamor_device *wlglamor_screen_priv(ScreenPtr pScreen)
     return wlglamor_scrninfo_priv(xf86Screens[pScreen->myNum]);
 }
 
+static inline uint64_t wlglamor_bo_size(struct gbm_bo *bo)
+{
+    return (uint64_t) gbm_bo_get_stride(bo) * gbm_bo_get_height(bo);
+}
+
+static inline Bool wlglamor_over_budget(struct wlglamor_device *wlglamor)
+{
+    return wlglamor->memory_budget &&
+	wlglamor->bo_bytes > wlglamor->memory_budget;
+}
+
+/* wlglamor.c */
+extern DevPrivateKeyRec wlglamor_pixmap_private_key_rec;
+#define wlglamor_pixmap_private_key  (&wlglamor_pixmap_private_key_rec)
+
+void wlglamor_gem_close(int fd, uint32_t handle);
+Bool wlglamor_depth_is_textured(int depth);
+struct gbm_bo *wlglamor_bo_create(struct wlglamor_device *wlglamor,
+				  int w, int h, int depth, uint32_t flags);
+void wlglamor_bo_destroy(struct wlglamor_device *wlglamor, struct gbm_bo *bo);
+PixmapPtr wlglamor_bo_pixmap(ScreenPtr screen, struct gbm_bo *bo,
+			     int w, int h, int depth);
+void wlglamor_bo_pixmap_destroy(PixmapPtr pixmap);
+void wlglamor_drain_deferred_destroy(struct wlglamor_device *wlglamor);
+Bool wlglamor_pixmap_read(PixmapPtr pixmap, int x, int y, int w, int h,
+			  char *dst);
+void wlglamor_pixmap_charge(struct wlglamor_device *wlglamor,
+			    struct wlglamor_pixmap *priv);
+void wlglamor_pixmap_uncharge(struct wlglamor_device *wlglamor,
+			      struct wlglamor_pixmap *priv);
+Bool wlglamor_alloc_known_bad(struct wlglamor_device *wlglamor,
+			      int w, int h, int depth, uint32_t flags);
+void wlglamor_alloc_failed(struct wlglamor_device *wlglamor,
+			   int w, int h, int depth, uint32_t flags);
+
+/* wlglamor_shm.c */
+void wlglamor_shm_init(ScreenPtr screen);
+void wlglamor_shm_sync(struct wlglamor_device *wlglamor);
+
+/* wlglamor_pressure.c */
+void wlglamor_pressure_init(ScrnInfoPtr pScrn,
+			    struct wlglamor_device *wlglamor);
+void wlglamor_pressure_fini(struct wlglamor_device *wlglamor);
+void wlglamor_pixmap_touch(struct wlglamor_device *wlglamor,
+			   struct wlglamor_pixmap *priv);
+Bool wlglamor_pixmap_promote(PixmapPtr pixmap);
+void wlglamor_promote_fallbacks(struct wlglamor_device *wlglamor);
+void wlglamor_trim(struct wlglamor_device *wlglamor);
+
+/* wlglamor_cold.c */
+#ifdef HAVE_LZ4
+Bool wlglamor_pixmap_freeze(PixmapPtr pixmap);
+#endif
+Bool wlglamor_pixmap_thaw(PixmapPtr pixmap);
+
+/* wlglamor_dedup.c */
+Bool wlglamor_dedup_leave(struct wlglamor_device *wlglamor,
+			  struct wlglamor_pixmap *priv);
+Bool wlglamor_pixmap_own(PixmapPtr pixmap);
+Bool wlglamor_pixmap_dedup(PixmapPtr pixmap);
+Bool wlglamor_pixmap_dedup_candidate(struct wlglamor_pixmap *priv, CARD32 now);
+
 #endif
@@ -0,0 +1,138 @@
+/*
+ * Copyright © 2002 SuSE Linux AG
+ * Copyright © 2008 Kristian Høgsberg
+ * Copyright © 2008 Jérôme Glisse
+ * Copyright © 2009 Red Hat, Inc.
+ * Copyright © 2010 commonIT
+ * Copyright © 2011 Intel Corporation.
+ * Copyright © 2012 Advanced Micro Devices, Inc.
+ * Copyright © 2012 Raspberry Pi Foundation
+ * Copyright © 2013 Axel Davy
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "xf86.h"
+#include "wlglamor.h"
+
+#ifdef HAVE_LZ4
+#include <lz4.h>
+
+/*
+ * Cold store: pixmaps left alone for ColdPixmapTimeout are demoted, then
+ * their contents are LZ4 compressed and the uncompressed copy freed. UI
+ * content (flat areas, text, icons) compresses very well. The pixmap has
+ * no storage at all while cold, so every way in goes through
+ * wlglamor_pixmap_use, which restores it first or fails: the drawing
+ * that needed it is then skipped, there is no error to return for it.
+ */
+Bool
+wlglamor_pixmap_freeze (PixmapPtr pixmap)
+{
+  ScreenPtr screen = pixmap->drawable.pScreen;
+  struct wlglamor_device *wlglamor = wlglamor_screen_priv (screen);
+  struct wlglamor_pixmap *priv;
+  int size = pixmap->devKind * pixmap->drawable.height;
+  int bound = LZ4_compressBound (size);
+  char *buf, *cold;
+  int len;
+
+  priv = dixLookupPrivate (&pixmap->devPrivates, wlglamor_pixmap_private_key);
+  if (!priv || !priv->sysmem || pixmap->refcnt != 1 ||
+      pixmap->usage_hint == CREATE_PIXMAP_USAGE_GLYPH_PICTURE)
+    return FALSE;
+
+  buf = malloc (bound);
+  if (!buf)
+    return FALSE;
+
+  len = LZ4_compress_default (priv->sysmem, buf, size, bound);
+  if (len <= 0)
+    {
+      free (buf);
+      return FALSE;
+    }
+  cold = realloc (buf, len);
+  if (!cold)
+    cold = buf;
+
+  free (priv->sysmem);
+  priv->sysmem = NULL;
+  priv->cold = cold;
+  priv->cold_size = len;
+  wlglamor->cold_bytes += len;
+  wlglamor->cold_raw_bytes += size;
+
+  screen->ModifyPixmapHeader (pixmap, pixmap->drawable.width,
+			      pixmap->drawable.height, 0, 0,
+			      pixmap->devKind, NULL);
+  pixmap->devPrivate.ptr = NULL;
+  pixmap->drawable.serialNumber = NEXT_SERIAL_NUMBER;
+
+  xorg_list_del (&priv->link);
+  xorg_list_append (&priv->link, &wlglamor->cold_pixmaps);
+  return TRUE;
+}
+#endif
+
+/* Decompress a cold pixmap back into system memory */
+Bool
+wlglamor_pixmap_thaw (PixmapPtr pixmap)
+{
+#ifdef HAVE_LZ4
+  ScreenPtr screen = pixmap->drawable.pScreen;
+  struct wlglamor_device *wlglamor = wlglamor_screen_priv (screen);
+  struct wlglamor_pixmap *priv;
+  int size = pixmap->devKind * pixmap->drawable.height;
+  void *data;
+
+  priv = dixLookupPrivate (&pixmap->devPrivates, wlglamor_pixmap_private_key);
+  if (!priv || !priv->cold)
+    return TRUE;
+
+  data = malloc (size);
+  if (!data)
+    return FALSE;
+
+  if (LZ4_decompress_safe (priv->cold, data, priv->cold_size, size) != size)
+    {
+      free (data);
+      return FALSE;
+    }
+
+  wlglamor->cold_bytes -= priv->cold_size;
+  wlglamor->cold_raw_bytes -= size;
+  free (priv->cold);
+  priv->cold = NULL;
+  priv->sysmem = data;
+  screen->ModifyPixmapHeader (pixmap, pixmap->drawable.width,
+			      pixmap->drawable.height, 0, 0,
+			      pixmap->devKind, data);
+  pixmap->drawable.serialNumber = NEXT_SERIAL_NUMBER;
+
+  xorg_list_del (&priv->link);
+  xorg_list_append (&priv->link, &wlglamor->demoted_pixmaps);
+#endif
+  return TRUE;
+}
@@ -0,0 +1,253 @@
+/*
+ * Copyright © 2002 SuSE Linux AG
+ * Copyright © 2008 Kristian Høgsberg
+ * Copyright © 2008 Jérôme Glisse
+ * Copyright © 2009 Red Hat, Inc.
+ * Copyright © 2010 commonIT
+ * Copyright © 2011 Intel Corporation.
+ * Copyright © 2012 Advanced Micro Devices, Inc.
+ * Copyright © 2012 Raspberry Pi Foundation
+ * Copyright © 2013 Axel Davy
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "xf86.h"
+#include "gcstruct.h"
+#include "wlglamor.h"
+
+#define GLAMOR_FOR_XORG  1
+#include <glamor.h>
+#include <gbm.h>
+
+/*
+ * Deduplication: once a pixmap has not been written to for a while (the
+ * usual icon, tile or theme image upload), its contents are hashed and
+ * pixmaps with identical contents are pointed at one BO. Sharing is
+ * copy-on-write: every path writing into a pixmap goes through
+ * wlglamor_pixmap_own first. Joining and leaving a BO swap the glamor
+ * textures of the pixmap and a scratch pixmap around the BO with
+ * glamor_egl_exchange_buffers, which works whatever the pixmap refcnt.
+ */
+
+/* Move pixmap onto the BO tmp was created for. tmp gets the old texture. */
+static void
+wlglamor_pixmap_swap_bo (PixmapPtr pixmap, PixmapPtr tmp,
+			 struct gbm_bo *bo)
+{
+  struct wlglamor_pixmap *priv;
+
+  priv = dixLookupPrivate (&pixmap->devPrivates, wlglamor_pixmap_private_key);
+  glamor_egl_exchange_buffers (pixmap, tmp);
+  priv->bo = bo;
+  pixmap->devKind = gbm_bo_get_stride (bo);
+  /* GCs validated against the old BO must be validated again */
+  pixmap->drawable.serialNumber = NEXT_SERIAL_NUMBER;
+}
+
+/* Returns TRUE if the caller is left as the only user of priv->bo */
+Bool
+wlglamor_dedup_leave (struct wlglamor_device *wlglamor,
+		      struct wlglamor_pixmap *priv)
+{
+  struct wlglamor_dedup *shared = priv->shared;
+
+  if (!shared)
+    return TRUE;
+
+  xorg_list_del (&priv->shared_link);
+  priv->shared = NULL;
+  if (--shared->count)
+    {
+      wlglamor->dedup_saved -= wlglamor_bo_size (shared->bo);
+      return FALSE;
+    }
+
+  xorg_list_del (&shared->link);
+  free (shared);
+  return TRUE;
+}
+
+/* Make sure writing into the pixmap only affects that pixmap */
+Bool
+wlglamor_pixmap_own (PixmapPtr pixmap)
+{
+  ScreenPtr screen = pixmap->drawable.pScreen;
+  struct wlglamor_device *wlglamor = wlglamor_screen_priv (screen);
+  struct wlglamor_pixmap *priv;
+  struct gbm_bo *bo;
+  PixmapPtr tmp;
+  GCPtr gc;
+
+  priv = dixLookupPrivate (&pixmap->devPrivates, wlglamor_pixmap_private_key);
+  if (!priv || !priv->shared)
+    return TRUE;
+  if (priv->shared->count == 1)
+    return wlglamor_dedup_leave (wlglamor, priv);
+
+  bo = wlglamor_bo_create (wlglamor, pixmap->drawable.width,
+			   pixmap->drawable.height, pixmap->drawable.depth,
+			   priv->bo_flags);
+  if (!bo)
+    return FALSE;
+
+  tmp = wlglamor_bo_pixmap (screen, bo, pixmap->drawable.width,
+			    pixmap->drawable.height, pixmap->drawable.depth);
+  gc = tmp ? GetScratchGC (pixmap->drawable.depth, screen) : NULL;
+  if (!gc)
+    {
+      if (tmp)
+	wlglamor_bo_pixmap_destroy (tmp);
+      wlglamor_bo_destroy (wlglamor, bo);
+      return FALSE;
+    }
+
+  ValidateGC (&tmp->drawable, gc);
+  gc->ops->CopyArea (&pixmap->drawable, &tmp->drawable, gc, 0, 0,
+		     pixmap->drawable.width, pixmap->drawable.height, 0, 0);
+  FreeScratchGC (gc);
+
+  wlglamor_dedup_leave (wlglamor, priv);
+  wlglamor_pixmap_swap_bo (pixmap, tmp, bo);
+  wlglamor_bo_pixmap_destroy (tmp);
+  /* Memory of its own again, at the expense of its client */
+  wlglamor_pixmap_charge (wlglamor, priv);
+  return TRUE;
+}
+
+static uint64_t
+wlglamor_dedup_hash (const unsigned char *data, size_t size)
+{
+  uint64_t hash = 0xcbf29ce484222325ULL;	/* FNV-1a */
+  size_t i;
+
+  for (i = 0; i < size; i++)
+    hash = (hash ^ data[i]) * 0x100000001b3ULL;
+
+  return hash;
+}
+
+/* Hash an idle pixmap and share the BO of an identical one, if any */
+Bool
+wlglamor_pixmap_dedup (PixmapPtr pixmap)
+{
+  ScreenPtr screen = pixmap->drawable.pScreen;
+  struct wlglamor_device *wlglamor = wlglamor_screen_priv (screen);
+  struct wlglamor_pixmap *priv, *other;
+  struct wlglamor_dedup *shared;
+  struct xorg_list *bucket;
+  int w = pixmap->drawable.width;
+  int h = pixmap->drawable.height;
+  int stride = PixmapBytePad (w, pixmap->drawable.depth);
+  unsigned char *data, *other_data = NULL;
+  uint64_t hash;
+  PixmapPtr tmp;
+
+  priv = dixLookupPrivate (&pixmap->devPrivates, wlglamor_pixmap_private_key);
+  data = malloc (stride * h);
+  if (!data)
+    return FALSE;
+  /* Not read back again until it is written to */
+  priv->hashed = TRUE;
+
+  /* Bypass our own GetImage hook, reading is not a use */
+  if (!wlglamor_pixmap_read (pixmap, 0, 0, w, h, (char *) data))
+    wlglamor->GetImage (&pixmap->drawable, 0, 0, w, h, ZPixmap, ~0,
+			(char *) data);
+  hash = wlglamor_dedup_hash (data, stride * h);
+  bucket = &wlglamor->dedup_table[hash % WLGLAMOR_DEDUP_BUCKETS];
+
+  xorg_list_for_each_entry (shared, bucket, link)
+    {
+      if (shared->hash != hash)
+	continue;
+      other = xorg_list_first_entry (&shared->members,
+				     struct wlglamor_pixmap, shared_link);
+      if (other->pixmap->drawable.width != w ||
+	  other->pixmap->drawable.height != h ||
+	  other->pixmap->drawable.depth != pixmap->drawable.depth)
+	continue;
+
+      /* Same hash is not same contents */
+      if (!other_data)
+	other_data = malloc (stride * h);
+      if (!other_data)
+	break;
+      if (!wlglamor_pixmap_read (other->pixmap, 0, 0, w, h,
+				 (char *) other_data))
+	wlglamor->GetImage (&other->pixmap->drawable, 0, 0, w, h, ZPixmap,
+			    ~0, (char *) other_data);
+      if (memcmp (data, other_data, stride * h))
+	continue;
+
+      tmp = wlglamor_bo_pixmap (screen, shared->bo, w, h,
+				pixmap->drawable.depth);
+      if (!tmp)
+	break;
+
+      wlglamor_pixmap_uncharge (wlglamor, priv);
+      wlglamor_bo_destroy (wlglamor, priv->bo);
+      wlglamor_pixmap_swap_bo (pixmap, tmp, shared->bo);
+      wlglamor_bo_pixmap_destroy (tmp);
+
+      priv->shared = shared;
+      xorg_list_append (&priv->shared_link, &shared->members);
+      shared->count++;
+      wlglamor->dedup_saved += wlglamor_bo_size (shared->bo);
+      wlglamor->dedup_saved_peak = max (wlglamor->dedup_saved,
+					wlglamor->dedup_saved_peak);
+      free (other_data);
+      free (data);
+      return TRUE;
+    }
+
+  free (other_data);
+  free (data);
+
+  /* First of its kind, others may join later */
+  shared = calloc (1, sizeof (*shared));
+  if (!shared)
+    return FALSE;
+  shared->hash = hash;
+  shared->bo = priv->bo;
+  shared->count = 1;
+  xorg_list_init (&shared->members);
+  xorg_list_append (&priv->shared_link, &shared->members);
+  xorg_list_append (&shared->link, bucket);
+  priv->shared = shared;
+  /* From now on writes must go through wlglamor_pixmap_own */
+  pixmap->drawable.serialNumber = NEXT_SERIAL_NUMBER;
+  return TRUE;
+}
+
+Bool
+wlglamor_pixmap_dedup_candidate (struct wlglamor_pixmap *priv, CARD32 now)
+{
+  PixmapPtr pixmap = priv->pixmap;
+
+  return priv->bo && !priv->shared && !priv->hashed && !priv->exported &&
+    pixmap->usage_hint != CREATE_PIXMAP_USAGE_BACKING_PIXMAP &&
+    pixmap->devKind * pixmap->drawable.height <= WLGLAMOR_DEDUP_MAX_SIZE &&
+    (CARD32) (now - priv->last_write) >= WLGLAMOR_DEDUP_DELAY;
+}
@@ -0,0 +1,394 @@
+/*
+ * Copyright © 2002 SuSE Linux AG
+ * Copyright © 2008 Kristian Høgsberg
+ * Copyright © 2008 Jérôme Glisse
+ * Copyright © 2009 Red Hat, Inc.
+ * Copyright © 2010 commonIT
+ * Copyright © 2011 Intel Corporation.
+ * Copyright © 2012 Advanced Micro Devices, Inc.
+ * Copyright © 2012 Raspberry Pi Foundation
+ * Copyright © 2013 Axel Davy
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "xf86.h"
+#include "fb.h"
+#include "gcstruct.h"
+#include "wlglamor.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#define GLAMOR_FOR_XORG  1
+#include <glamor.h>
+#include <gbm.h>
+
+/* Move a pixmap to the most recently used end of its list */
+void
+wlglamor_pixmap_touch (struct wlglamor_device *wlglamor,
+		       struct wlglamor_pixmap *priv)
+{
+  priv->last_use = GetTimeInMillis ();
+  xorg_list_del (&priv->link);
+  xorg_list_append (&priv->link, priv->bo ? &wlglamor->pixmaps :
+		    &wlglamor->demoted_pixmaps);
+}
+
+/*
+ * Under memory pressure, idle pixmaps nobody outside the server knows
+ * about give their BO back: the contents are read into system memory and
+ * the pixmap becomes a plain fb pixmap, which glamor handles like any
+ * other memory pixmap. glamor can only drop the texture of a pixmap
+ * holding a single reference.
+ */
+static Bool
+wlglamor_pixmap_demote (PixmapPtr pixmap)
+{
+  ScreenPtr screen = pixmap->drawable.pScreen;
+  struct wlglamor_device *wlglamor = wlglamor_screen_priv (screen);
+  struct wlglamor_pixmap *priv;
+  int w = pixmap->drawable.width;
+  int h = pixmap->drawable.height;
+  int stride = PixmapBytePad (w, pixmap->drawable.depth);
+  void *data;
+
+  priv = dixLookupPrivate (&pixmap->devPrivates, wlglamor_pixmap_private_key);
+  if (!priv || !priv->bo || priv->exported || pixmap->refcnt != 1)
+    return FALSE;
+  if (priv->shared && priv->shared->count > 1)
+    return FALSE;
+
+  data = malloc (stride * h);
+  if (!data)
+    return FALSE;
+
+  /* Bypass our own GetImage hook, reading is not a use */
+  if (!wlglamor_pixmap_read (pixmap, 0, 0, w, h, data))
+    wlglamor->GetImage (&pixmap->drawable, 0, 0, w, h, ZPixmap, ~0, data);
+
+  glamor_egl_destroy_textured_pixmap (pixmap);
+  wlglamor_dedup_leave (wlglamor, priv);
+  wlglamor_pixmap_uncharge (wlglamor, priv);
+  wlglamor_bo_destroy (wlglamor, priv->bo);
+  priv->bo = NULL;
+  priv->sysmem = data;
+  screen->ModifyPixmapHeader (pixmap, w, h, 0, 0, stride, data);
+  /* A partial header update keeps the serial number, yet GCs validated
+   * against the BO must be validated again */
+  pixmap->drawable.serialNumber = NEXT_SERIAL_NUMBER;
+
+  xorg_list_del (&priv->link);
+  xorg_list_append (&priv->link, &wlglamor->demoted_pixmaps);
+  return TRUE;
+}
+
+/* Give a demoted pixmap a BO again and upload its contents */
+Bool
+wlglamor_pixmap_promote (PixmapPtr pixmap)
+{
+  ScreenPtr screen = pixmap->drawable.pScreen;
+  struct wlglamor_device *wlglamor = wlglamor_screen_priv (screen);
+  struct wlglamor_pixmap *priv;
+  union gbm_bo_handle handle;
+  int w = pixmap->drawable.width;
+  int h = pixmap->drawable.height;
+  int depth = pixmap->drawable.depth;
+  int stride = pixmap->devKind;
+  void *data;
+  GCPtr gc;
+
+  priv = dixLookupPrivate (&pixmap->devPrivates, wlglamor_pixmap_private_key);
+  if (!priv)
+    return TRUE;
+  if (!wlglamor_pixmap_thaw (pixmap))
+    return FALSE;
+  if (!priv->sysmem)
+    return TRUE;
+
+  /* A backing pixmap demoted before it was first shown still has to be
+   * scanout capable */
+  priv->bo = wlglamor_bo_create (wlglamor, w, h, depth, priv->bo_flags);
+  if (!priv->bo)
+    return FALSE;
+
+  data = priv->sysmem;
+  handle = gbm_bo_get_handle (priv->bo);
+  screen->ModifyPixmapHeader (pixmap, w, h, 0, 0,
+			      gbm_bo_get_stride (priv->bo), NULL);
+  pixmap->devPrivate.ptr = NULL;
+  if (!glamor_egl_create_textured_pixmap (pixmap, handle.u32,
+					  gbm_bo_get_stride (priv->bo)))
+    {
+      wlglamor_bo_destroy (wlglamor, priv->bo);
+      priv->bo = NULL;
+      screen->ModifyPixmapHeader (pixmap, w, h, 0, 0, stride, data);
+      return FALSE;
+    }
+  priv->sysmem = NULL;
+  pixmap->drawable.serialNumber = NEXT_SERIAL_NUMBER;
+  priv->fallback = FALSE;
+  wlglamor_pixmap_charge (wlglamor, priv);
+
+  gc = GetScratchGC (depth, screen);
+  if (gc)
+    {
+      ValidateGC (&pixmap->drawable, gc);
+      gc->ops->PutImage (&pixmap->drawable, gc, depth, 0, 0, w, h, 0,
+			 ZPixmap, data);
+      FreeScratchGC (gc);
+    }
+  free (data);
+
+  wlglamor_pixmap_touch (wlglamor, priv);
+  return TRUE;
+}
+
+/* Upload the fallback pixmaps the GPU used, a few at a time, while
+ * there is memory for them. Stop at the first allocation failure. */
+void
+wlglamor_promote_fallbacks (struct wlglamor_device *wlglamor)
+{
+  struct wlglamor_pixmap *priv, *tmp;
+  int promoted = 0;
+
+  if (wlglamor->under_pressure || wlglamor_over_budget (wlglamor))
+    return;
+
+  xorg_list_for_each_entry_safe (priv, tmp, &wlglamor->fallback_pixmaps,
+				 link)
+    {
+      PixmapPtr pixmap = priv->pixmap;
+      int w = pixmap->drawable.width;
+      int h = pixmap->drawable.height;
+      int depth = pixmap->drawable.depth;
+      Bool offscreen = !(priv->bo_flags & GBM_BO_USE_SCANOUT);
+
+      if (promoted == WLGLAMOR_PROMOTE_PER_CYCLE)
+	return;
+      if (offscreen &&
+	  wlglamor_alloc_known_bad (wlglamor, w, h, depth, priv->bo_flags))
+	continue;
+      if (!wlglamor_pixmap_promote (pixmap))
+	{
+	  if (offscreen)
+	    wlglamor_alloc_failed (wlglamor, w, h, depth, priv->bo_flags);
+	  return;
+	}
+      promoted++;
+    }
+}
+
+/* Pick the least recently used pixmaps first, until the pressure goes
+ * away. Pixmaps used within the idle timeout are left alone. */
+void
+wlglamor_trim (struct wlglamor_device *wlglamor)
+{
+  struct wlglamor_pixmap *priv, *tmp;
+  CARD32 now = GetTimeInMillis ();
+  int demoted = 0;
+
+  wlglamor_drain_deferred_destroy (wlglamor);
+
+  xorg_list_for_each_entry_safe (priv, tmp, &wlglamor->pixmaps, link)
+    {
+      CARD32 idle = now - priv->last_use;
+      Bool pressure = wlglamor->under_pressure ||
+	wlglamor_over_budget (wlglamor);
+
+      if (!(pressure && idle >= wlglamor->idle_timeout) &&
+	  !(wlglamor->cold_timeout && idle >= wlglamor->cold_timeout))
+	break;
+      if (demoted == WLGLAMOR_DEMOTE_PER_CYCLE)
+	return;			/* carry on at the next block handler */
+      if (wlglamor_pixmap_demote (priv->pixmap))
+	demoted++;
+    }
+
+#ifdef HAVE_LZ4
+  if (wlglamor->cold_timeout)
+    {
+      xorg_list_for_each_entry_safe (priv, tmp, &wlglamor->demoted_pixmaps,
+				     link)
+	{
+	  if ((CARD32) (now - priv->last_use) < wlglamor->cold_timeout)
+	    continue;
+	  if (demoted == WLGLAMOR_DEMOTE_PER_CYCLE)
+	    return;
+	  if (wlglamor_pixmap_freeze (priv->pixmap))
+	    demoted++;
+	}
+    }
+#endif
+
+  if (wlglamor->dedup)
+    {
+      int hashed = 0;
+
+      xorg_list_for_each_entry_safe (priv, tmp, &wlglamor->pixmaps, link)
+	{
+	  if (!wlglamor_pixmap_dedup_candidate (priv, now))
+	    continue;
+	  if (hashed == WLGLAMOR_DEDUP_PER_CYCLE)
+	    return;
+	  wlglamor_pixmap_dedup (priv->pixmap);
+	  hashed++;
+	}
+    }
+
+  wlglamor->trim_pending = FALSE;
+}
+
+static int
+wlglamor_read_fd (int fd, char *buf, size_t size)
+{
+  ssize_t len;
+
+  len = pread (fd, buf, size - 1, 0);
+  if (len < 0)
+    return -1;
+  buf[len] = '\0';
+  return len;
+}
+
+/* PSI (/proc/pressure/memory) or a cgroup v2 memory.events telling us
+ * the kernel is reclaiming or about to. */
+static Bool
+wlglamor_check_pressure (struct wlglamor_device *wlglamor)
+{
+  char buf[256], *line;
+  Bool pressure = FALSE;
+
+  if (wlglamor->psi_fd >= 0 &&
+      wlglamor_read_fd (wlglamor->psi_fd, buf, sizeof (buf)) > 0)
+    {
+      double avg10;
+
+      if (sscanf (buf, "some avg10=%lf", &avg10) == 1 &&
+	  avg10 >= wlglamor->pressure_threshold)
+	pressure = TRUE;
+    }
+
+  if (wlglamor->cgroup_events_fd >= 0 &&
+      wlglamor_read_fd (wlglamor->cgroup_events_fd, buf, sizeof (buf)) > 0)
+    {
+      unsigned long events = 0, count;
+      char key[32];
+
+      for (line = buf; line && *line; line = strchr (line, '\n'))
+	{
+	  if (*line == '\n')
+	    line++;
+	  if (sscanf (line, "%31s %lu", key, &count) == 2 &&
+	      (!strcmp (key, "high") || !strcmp (key, "max") ||
+	       !strcmp (key, "oom")))
+	    events += count;
+	}
+      if (events != wlglamor->cgroup_events)
+	pressure = TRUE;
+      wlglamor->cgroup_events = events;
+    }
+
+  return pressure;
+}
+
+static CARD32
+wlglamor_pressure_timer (OsTimerPtr timer, CARD32 time, pointer arg)
+{
+  struct wlglamor_device *wlglamor = arg;
+
+  wlglamor->under_pressure = wlglamor_check_pressure (wlglamor);
+  if (wlglamor->under_pressure || wlglamor->cold_timeout || wlglamor->dedup)
+    wlglamor->trim_pending = TRUE;
+
+  return WLGLAMOR_PRESSURE_CHECK_INTERVAL;
+}
+
+void
+wlglamor_pressure_init (ScrnInfoPtr pScrn, struct wlglamor_device *wlglamor)
+{
+  char line[512], path[512];
+  FILE *f;
+  int i;
+
+  xorg_list_init (&wlglamor->pixmaps);
+  xorg_list_init (&wlglamor->demoted_pixmaps);
+  xorg_list_init (&wlglamor->cold_pixmaps);
+  xorg_list_init (&wlglamor->fallback_pixmaps);
+  for (i = 0; i < WLGLAMOR_DEDUP_BUCKETS; i++)
+    xorg_list_init (&wlglamor->dedup_table[i]);
+  wlglamor->psi_fd = -1;
+  wlglamor->cgroup_events_fd = -1;
+
+  if (wlglamor->cold_timeout || wlglamor->dedup)
+    wlglamor->pressure_timer = TimerSet (NULL, 0,
+					 WLGLAMOR_PRESSURE_CHECK_INTERVAL,
+					 wlglamor_pressure_timer, wlglamor);
+
+  if (wlglamor->pressure_threshold <= 0)
+    return;
+
+  wlglamor->psi_fd = open ("/proc/pressure/memory", O_RDONLY | O_CLOEXEC);
+
+  f = fopen ("/proc/self/cgroup", "r");
+  if (f)
+    {
+      while (fgets (line, sizeof (line), f))
+	{
+	  if (strncmp (line, "0::", 3))
+	    continue;
+	  line[strcspn (line, "\n")] = '\0';
+	  snprintf (path, sizeof (path), "/sys/fs/cgroup%s/memory.events",
+		    line + 3);
+	  wlglamor->cgroup_events_fd = open (path, O_RDONLY | O_CLOEXEC);
+	  break;
+	}
+      fclose (f);
+    }
+
+  if (wlglamor->psi_fd < 0 && wlglamor->cgroup_events_fd < 0)
+    {
+      xf86DrvMsg (pScrn->scrnIndex, X_INFO,
+		  "No memory pressure source available\n");
+      return;
+    }
+
+  wlglamor_check_pressure (wlglamor);	/* cgroup event baseline */
+  wlglamor->pressure_timer = TimerSet (wlglamor->pressure_timer, 0,
+				       WLGLAMOR_PRESSURE_CHECK_INTERVAL,
+				       wlglamor_pressure_timer, wlglamor);
+}
+
+void
+wlglamor_pressure_fini (struct wlglamor_device *wlglamor)
+{
+  TimerFree (wlglamor->pressure_timer);
+  wlglamor->pressure_timer = NULL;
+  if (wlglamor->psi_fd >= 0)
+    close (wlglamor->psi_fd);
+  if (wlglamor->cgroup_events_fd >= 0)
+    close (wlglamor->cgroup_events_fd);
+  wlglamor->psi_fd = wlglamor->cgroup_events_fd = -1;
+}
@@ -0,0 +1,212 @@
+/*
+ * Copyright © 2002 SuSE Linux AG
+ * Copyright © 2008 Kristian Høgsberg
+ * Copyright © 2008 Jérôme Glisse
+ * Copyright © 2009 Red Hat, Inc.
+ * Copyright © 2010 commonIT
+ * Copyright © 2011 Intel Corporation.
+ * Copyright © 2012 Advanced Micro Devices, Inc.
+ * Copyright © 2012 Raspberry Pi Foundation
+ * Copyright © 2013 Axel Davy
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "xf86.h"
+#include "wlglamor.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+#ifdef MITSHM
+#include "shmint.h"
+#endif
+
+#define GLAMOR_FOR_XORG  1
+#include <glamor.h>
+#include "xf86drm.h"
+#include "i915_drm.h"
+
+/*
+ * The client reads a shm pixmap as soon as its request completes, so
+ * GPU rendering into one should be finished by the time replies and
+ * events go out. The wait blocks, so it is only done from the block
+ * handler, once glamor flushed, and only if the write hooks put pixmaps
+ * on the list since the last time. Replies flushed earlier in the same
+ * cycle can still beat the GPU, one reason ShmPixmapSize is off by
+ * default.
+ */
+void
+wlglamor_shm_sync (struct wlglamor_device *wlglamor)
+{
+#ifdef DRM_IOCTL_I915_GEM_USERPTR
+  struct wlglamor_pixmap *priv, *tmp;
+
+  xorg_list_for_each_entry_safe (priv, tmp, &wlglamor->shm_pixmaps, link)
+    {
+      struct drm_i915_gem_set_domain set_domain;
+
+      memset (&set_domain, 0, sizeof (set_domain));
+      set_domain.handle = priv->userptr;
+      set_domain.read_domains = I915_GEM_DOMAIN_CPU;
+      ioctl (wlglamor->fd, DRM_IOCTL_I915_GEM_SET_DOMAIN, &set_domain);
+      xorg_list_del (&priv->link);
+    }
+#endif
+}
+
+#if defined(MITSHM) && defined(DRM_IOCTL_I915_GEM_USERPTR)
+/*
+ * Whether the pages at addr are mapped writable. A client may attach
+ * its segment read-only, and the GPU would write through it anyway.
+ */
+static Bool
+wlglamor_shm_writable (const void *addr)
+{
+  uintptr_t start, end, ptr = (uintptr_t) addr;
+  char line[256], perms[5];
+  Bool writable = FALSE;
+  FILE *maps;
+
+  maps = fopen ("/proc/self/maps", "r");
+  if (!maps)
+    return FALSE;
+  while (fgets (line, sizeof (line), maps))
+    {
+      if (sscanf (line, "%" SCNxPTR "-%" SCNxPTR " %4s", &start, &end,
+		  perms) != 3)
+	continue;
+      if (ptr >= start && ptr < end)
+	{
+	  writable = perms[1] == 'w';
+	  break;
+	}
+    }
+  fclose (maps);
+  return writable;
+}
+
+/*
+ * MIT-SHM pixmaps of at least ShmPixmapSize bytes are textured from an
+ * i915 userptr object wrapping the client's segment, so what the client
+ * writes there is seen by the GPU without an upload. Like an exported
+ * pixmap it never moves, and its memory is the client's, not charged.
+ */
+static PixmapPtr
+wlglamor_shm_create_pixmap (ScreenPtr screen, int w, int h, int depth,
+			    char *addr)
+{
+  struct wlglamor_device *wlglamor = wlglamor_screen_priv (screen);
+  struct drm_i915_gem_userptr userptr;
+  struct wlglamor_pixmap *priv;
+  uint64_t page = getpagesize ();
+  int stride = PixmapBytePad (w, depth);
+  uint64_t size = (uint64_t) stride * h;
+  PixmapPtr pixmap;
+
+  pixmap = screen->CreatePixmap (screen, 0, 0, depth, 0);
+  if (pixmap == NullPixmap)
+    return NullPixmap;
+  if (!screen->ModifyPixmapHeader (pixmap, w, h, depth, BitsPerPixel (depth),
+				   stride, addr))
+    {
+      screen->DestroyPixmap (pixmap);
+      return NullPixmap;
+    }
+
+  /* Segments are whole pages, the pixmap has to start on one and the
+   * GPU wants its pitch 64 byte aligned */
+  if (!wlglamor->shm_userptr || size < wlglamor->shm_pixmap_size ||
+      !wlglamor_depth_is_textured (depth) ||
+      ((uintptr_t) addr & (page - 1)) || (stride & 63) ||
+      !wlglamor_shm_writable (addr))
+    return pixmap;
+
+  priv = calloc (1, sizeof (struct wlglamor_pixmap));
+  if (!priv)
+    return pixmap;
+
+  memset (&userptr, 0, sizeof (userptr));
+  userptr.user_ptr = (uintptr_t) addr;
+  userptr.user_size = (size + page - 1) & ~(page - 1);
+  if (ioctl (wlglamor->fd, DRM_IOCTL_I915_GEM_USERPTR, &userptr) < 0)
+    {
+      if (errno == EINVAL || errno == ENOTTY || errno == ENODEV)
+	{
+	  xf86DrvMsg (wlglamor->scrn_index, X_INFO,
+		      "No userptr support, shm pixmaps stay in system memory\n");
+	  wlglamor->shm_userptr = FALSE;
+	}
+      free (priv);
+      return pixmap;
+    }
+
+  if (!glamor_egl_create_textured_pixmap (pixmap, userptr.handle, stride))
+    {
+      wlglamor_gem_close (wlglamor->fd, userptr.handle);
+      free (priv);
+      return pixmap;
+    }
+
+  priv->refcount = 1;
+  priv->pixmap = pixmap;
+  priv->exported = TRUE;
+  priv->userptr = userptr.handle;
+  xorg_list_init (&priv->link);
+  dixSetPrivate (&pixmap->devPrivates, wlglamor_pixmap_private_key, priv);
+  return pixmap;
+}
+
+static ShmFuncs wlglamor_shm_funcs = {
+  wlglamor_shm_create_pixmap,
+  NULL
+};
+#endif
+
+/* Register the shm hooks on i915 when ShmPixmapSize is set */
+void
+wlglamor_shm_init (ScreenPtr screen)
+{
+#if defined(MITSHM) && defined(DRM_IOCTL_I915_GEM_USERPTR)
+  struct wlglamor_device *wlglamor = wlglamor_screen_priv (screen);
+  drmVersionPtr version;
+
+  if (!wlglamor->shm_pixmap_size)
+    return;
+
+  version = drmGetVersion (wlglamor->fd);
+  /* DRM_IOCTL_I915_GEM_USERPTR is a driver ioctl, its number means
+   * something else to any other driver */
+  if (version && !strcmp (version->name, "i915"))
+    {
+      wlglamor->shm_userptr = TRUE;
+      ShmRegisterFuncs (screen, &wlglamor_shm_funcs);
+    }
+  if (version)
+    drmFreeVersion (version);
+#endif
+}